@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <vector>
+#include <utility>
+
+#include "Network.hpp"
+
+namespace net {
+
+// hash table from addresses to T with open addressing and linear probing in
+// one array. erasing shifts the following entries of the probe run back
+// instead of leaving tombstones, so lookups never get slower with churn.
+// pointers to values are invalidated by insertions and erasures
+template <typename T>
+class AddrMap {
+  static constexpr size_t MIN_CAPACITY = 16;
+
+  struct Entry {
+    Addr addr;
+    bool used = false;
+    T value;
+  };
+
+  std::vector<Entry> entries;
+  size_t size_ = 0;
+
+  size_t mask() const {
+    return entries.size() - 1;
+  }
+
+  static size_t hash(const Addr &addr) {
+    uint64_t h = (uint64_t(addr.ip) << 16) | addr.port;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return size_t(h);
+  }
+
+  // the entry of addr or the free one where it would go
+  size_t slot_of(const Addr &addr) const {
+    size_t i = hash(addr) & mask();
+    while(entries[i].used && entries[i].addr != addr) {
+      i = (i + 1) & mask();
+    }
+    return i;
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<Entry> old(capacity);
+    old.swap(entries);
+    for(Entry &e : old) {
+      if(e.used) {
+        Entry &to = entries[slot_of(e.addr)];
+        to.addr = e.addr;
+        to.used = true;
+        to.value = std::move(e.value);
+      }
+    }
+  }
+public:
+  AddrMap():
+    entries(MIN_CAPACITY)
+  {}
+
+  T *find(const Addr &addr) {
+    Entry &e = entries[slot_of(addr)];
+    return e.used ? &e.value : nullptr;
+  }
+
+  const T *find(const Addr &addr) const {
+    const Entry &e = entries[slot_of(addr)];
+    return e.used ? &e.value : nullptr;
+  }
+
+  // the value of addr and whether it was inserted, default constructed
+  std::pair<T *, bool> insert(const Addr &addr) {
+    // at most half full, so that probe runs stay short
+    if(2 * (size_ + 1) > entries.size()) {
+      rehash(2 * entries.size());
+    }
+    Entry &e = entries[slot_of(addr)];
+    if(e.used) {
+      return {&e.value, false};
+    }
+    e.addr = addr;
+    e.used = true;
+    e.value = T();
+    ++size_;
+    return {&e.value, true};
+  }
+
+  bool erase(const Addr &addr) {
+    size_t i = slot_of(addr);
+    if(!entries[i].used) {
+      return false;
+    }
+    // entries after the hole which would not be found past it move into it
+    for(size_t j = (i + 1) & mask(); entries[j].used; j = (j + 1) & mask()) {
+      const size_t home = hash(entries[j].addr) & mask();
+      if(((j - home) & mask()) >= ((j - i) & mask())) {
+        entries[i] = std::move(entries[j]);
+        i = j;
+      }
+    }
+    entries[i].used = false;
+    entries[i].value = T();
+    --size_;
+    return true;
+  }
+
+  // func(addr, value) for every entry in no particular order
+  template <typename F>
+  void each(F &&func) {
+    for(Entry &e : entries) {
+      if(e.used) {
+        func(std::as_const(e.addr), e.value);
+      }
+    }
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+};
+
+}
@@ -0,0 +1,707 @@
+#pragma once
+
+#include <cmath>
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <limits>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "Debug.hpp"
+#include "Logger.hpp"
+#include "Timer.hpp"
+#include "Network.hpp"
+
+namespace net {
+
+class Scheduler;
+
+// a coroutine which starts suspended. it is either spawned on a scheduler,
+// which then owns it, or awaited by another task
+template <typename T=void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  // set for spawned tasks only
+  Scheduler *scheduler = nullptr;
+  std::exception_ptr exception;
+
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+
+  template <typename P>
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept;
+
+    void await_resume() noexcept
+    {}
+  };
+
+  void unhandled_exception() {
+    exception = std::current_exception();
+  }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+
+  FinalAwaiter<TaskPromise<T>> final_suspend() noexcept {
+    return {};
+  }
+
+  template <typename U>
+  void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+
+  T result() {
+    if(exception) {
+      std::rethrow_exception(exception);
+    }
+    return std::move(value.value());
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+
+  FinalAwaiter<TaskPromise<void>> final_suspend() noexcept {
+    return {};
+  }
+
+  void return_void()
+  {}
+
+  void result() {
+    if(exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+};
+
+} // namespace detail
+
+template <typename T>
+class Task {
+public:
+  using promise_type = detail::TaskPromise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+private:
+  handle_type handle_;
+
+  friend class Scheduler;
+
+  handle_type release() {
+    return std::exchange(handle_, nullptr);
+  }
+public:
+  explicit Task(handle_type handle):
+    handle_(handle)
+  {}
+
+  Task(Task &&other):
+    handle_(other.release())
+  {}
+
+  Task &operator=(Task &&other) {
+    if(this != &other) {
+      if(handle_) {
+        handle_.destroy();
+      }
+      handle_ = other.release();
+    }
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  ~Task() {
+    if(handle_) {
+      handle_.destroy();
+    }
+  }
+
+  // runs the task until it completes, then resumes the awaiting one
+  auto operator co_await() && {
+    struct Awaiter {
+      handle_type handle;
+
+      bool await_ready() {
+        return !handle || handle.done();
+      }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle.promise().continuation = caller;
+        return handle;
+      }
+
+      T await_resume() {
+        return handle.promise().result();
+      }
+    };
+    return Awaiter{ handle_ };
+  }
+};
+
+template <typename T>
+Task<T> detail::TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// raised from any thread, tasks wait for it with Scheduler::wait() or have it
+// interrupt readable(). it stays raised until it is cleared
+class Signal {
+  int event_;
+  std::atomic<bool> raised_;
+public:
+  Signal(bool raised=false):
+    raised_(raised)
+  {
+    event_ = eventfd(raised ? 1 : 0, EFD_NONBLOCK);
+    if(event_ == -1) {
+      perror("error");
+      TERMINATE("Can't create signal\n");
+    }
+  }
+
+  Signal(const Signal &) = delete;
+  Signal &operator=(const Signal &) = delete;
+
+  ~Signal() {
+    close(event_);
+  }
+
+  void raise() {
+    raised_ = true;
+    uint64_t one = 1;
+    if(write(event_, &one, sizeof(one)) != sizeof(one)) {
+      perror("error");
+    }
+  }
+
+  void clear() {
+    uint64_t count;
+    if(read(event_, &count, sizeof(count)) != sizeof(count)) {
+      errno = 0;
+    }
+    raised_ = false;
+  }
+
+  bool raised() const {
+    return raised_;
+  }
+
+  int descriptor() const {
+    return event_;
+  }
+};
+
+// runs tasks on the thread which calls run(). tasks sleep until a deadline or
+// until one of the descriptors they wait for becomes readable or writable, so
+// that any number of sockets and actors can share the thread
+class Scheduler {
+public:
+  static constexpr Timer::time_t FOREVER = std::numeric_limits<Timer::time_t>::infinity();
+  // datagrams handled by serve() before the other tasks get a turn
+  static constexpr int BATCH_SIZE = 32;
+private:
+  struct Waiter {
+    std::coroutine_handle<> handle;
+    std::vector<int> fds;
+    std::multimap<Timer::time_t, Waiter *>::iterator timer;
+    bool has_timer = false;
+    bool timed_out = false;
+  };
+
+  // the events each waiter waits for on a descriptor
+  struct Watch {
+    std::map<Waiter *, uint32_t> waiters;
+    uint32_t events = 0;
+  };
+
+  int epoll_;
+  int event_;
+  std::atomic<bool> stop_ = false;
+  std::deque<std::coroutine_handle<>> ready;
+  // spawned from any thread, started by the next round of run()
+  std::mutex incoming_mtx;
+  std::vector<std::coroutine_handle<detail::TaskPromise<void>>> incoming;
+  std::multimap<Timer::time_t, Waiter *> timers;
+  // every descriptor is registered with epoll once, for the events anyone
+  // waits for
+  std::map<int, Watch> watched;
+  std::set<std::coroutine_handle<>> spawned;
+  std::exception_ptr exception;
+
+  template <typename P>
+  friend struct detail::TaskPromiseBase::FinalAwaiter;
+
+  // a spawned task completed
+  void finished(std::coroutine_handle<> handle, std::exception_ptr e) {
+    if(e && !exception) {
+      exception = e;
+    }
+    spawned.erase(handle);
+    handle.destroy();
+  }
+
+  void take_incoming() {
+    std::lock_guard<std::mutex> guard(incoming_mtx);
+    for(auto handle : incoming) {
+      handle.promise().scheduler = this;
+      spawned.insert(handle);
+      ready.push_back(handle);
+    }
+    incoming.clear();
+  }
+
+  // registers the union of what is waited for on fd if it changed
+  void update(int fd, Watch &watch, uint32_t before) {
+    if(watch.events == before) {
+      return;
+    }
+    epoll_event ev;
+    ev.events = watch.events;
+    ev.data.fd = fd;
+    if(epoll_ctl(epoll_, (before == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == -1) {
+      perror("error");
+      TERMINATE("Can't register descriptor %d with epoll\n", fd);
+    }
+  }
+
+  void watch(Waiter &waiter, int fd, uint32_t events) {
+    Watch &watch = watched[fd];
+    const uint32_t before = watch.events;
+    auto [it, inserted] = watch.waiters.insert(std::make_pair(&waiter, events));
+    if(inserted) {
+      waiter.fds.push_back(fd);
+    } else {
+      it->second |= events;
+    }
+    watch.events |= events;
+    update(fd, watch, before);
+  }
+
+  void suspend(Waiter &waiter, const std::vector<int> &fds, Timer::time_t deadline) {
+    for(int fd : fds) {
+      watch(waiter, fd, EPOLLIN);
+    }
+    if(deadline != FOREVER) {
+      waiter.timer = timers.insert(std::make_pair(deadline, &waiter));
+      waiter.has_timer = true;
+    }
+  }
+
+  void wake(Waiter &waiter) {
+    for(int fd : waiter.fds) {
+      auto it = watched.find(fd);
+      Watch &watch = it->second;
+      watch.waiters.erase(&waiter);
+      if(watch.waiters.empty()) {
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+        watched.erase(it);
+        continue;
+      }
+      const uint32_t before = watch.events;
+      watch.events = 0;
+      for(const auto &[w, events] : watch.waiters) {
+        watch.events |= events;
+      }
+      update(fd, watch, before);
+    }
+    waiter.fds.clear();
+    if(waiter.has_timer) {
+      timers.erase(waiter.timer);
+      waiter.has_timer = false;
+    }
+    ready.push_back(waiter.handle);
+  }
+
+  static void notify(int fd) {
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("error");
+    }
+  }
+
+  static void consume(int fd) {
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+      errno = 0;
+    }
+  }
+
+  void run(bool linger) {
+    take_incoming();
+    while(!stop_ && (linger || !spawned.empty())) {
+      for(size_t n = ready.size(); n > 0 && !stop_; --n) {
+        auto handle = ready.front();
+        ready.pop_front();
+        handle.resume();
+        if(exception) {
+          std::rethrow_exception(std::exchange(exception, nullptr));
+        }
+      }
+      if(!stop_ && (linger || !spawned.empty())) {
+        poll();
+      }
+      take_incoming();
+    }
+  }
+
+  // sleeps until a descriptor is ready, stop() is called or the next deadline
+  // is due, then readies whoever waited for it. errors ready everyone
+  void poll() {
+    int timeout = -1;
+    if(!ready.empty()) {
+      timeout = 0;
+    } else if(!timers.empty()) {
+      Timer::time_t left = timers.begin()->first - Timer::system_time();
+      timeout = int(std::ceil(std::fmax(left, .0) * 1e3));
+    }
+    constexpr int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    int no_events = epoll_wait(epoll_, events, MAX_EVENTS, timeout);
+    for(int i = 0; i < no_events; ++i) {
+      const int fd = events[i].data.fd;
+      if(fd == event_) {
+        consume(event_);
+        continue;
+      }
+      auto it = watched.find(fd);
+      if(it == std::end(watched)) {
+        continue;
+      }
+      const uint32_t happened = events[i].events;
+      std::vector<Waiter *> woken;
+      for(const auto &[waiter, waited] : it->second.waiters) {
+        if((happened & (EPOLLERR | EPOLLHUP)) || (happened & waited)) {
+          woken.push_back(waiter);
+        }
+      }
+      for(Waiter *waiter : woken) {
+        wake(*waiter);
+      }
+    }
+    const Timer::time_t now = Timer::system_time();
+    while(!timers.empty() && timers.begin()->first <= now) {
+      Waiter &waiter = *timers.begin()->second;
+      waiter.timed_out = true;
+      wake(waiter);
+    }
+  }
+public:
+  Scheduler() {
+    epoll_ = epoll_create1(0);
+    if(epoll_ == -1) {
+      perror("error");
+      TERMINATE("Can't create epoll instance\n");
+    }
+    event_ = eventfd(0, EFD_NONBLOCK);
+    if(event_ == -1) {
+      perror("error");
+      TERMINATE("Can't create wakeup event\n");
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = event_;
+    if(epoll_ctl(epoll_, EPOLL_CTL_ADD, event_, &ev) == -1) {
+      perror("error");
+      TERMINATE("Can't register wakeup event with epoll\n");
+    }
+  }
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // tasks which did not complete are destroyed where they were suspended
+  ~Scheduler() {
+    for(auto handle : spawned) {
+      handle.destroy();
+    }
+    for(auto handle : incoming) {
+      handle.destroy();
+    }
+    close(event_);
+    close(epoll_);
+  }
+
+  // the task is started by run(), callable from any thread
+  void spawn(Task<void> &&task) {
+    {
+      std::lock_guard<std::mutex> guard(incoming_mtx);
+      incoming.push_back(task.release());
+    }
+    notify(event_);
+  }
+
+  // until every spawned task completed or stop() is called. an exception
+  // escaping a spawned task is rethrown here
+  void run() {
+    run(false);
+  }
+
+  // until stop() is called, tasks may come and go meanwhile
+  void run_until_stopped() {
+    run(true);
+  }
+
+  // makes run() return, callable from any thread. a scheduler which was
+  // stopped stays stopped, even if it was stopped before run() was called
+  void stop() {
+    stop_ = true;
+    notify(event_);
+  }
+
+  size_t size() const {
+    return spawned.size();
+  }
+
+  // lets the other ready tasks run first
+  auto yield() {
+    struct Awaiter {
+      Scheduler &scheduler;
+
+      bool await_ready() {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        scheduler.ready.push_back(handle);
+      }
+
+      void await_resume()
+      {}
+    };
+    return Awaiter{ *this };
+  }
+
+  // deadline in Timer::system_time()
+  auto sleep_until(Timer::time_t deadline) {
+    struct Awaiter {
+      Scheduler &scheduler;
+      Timer::time_t deadline;
+      Waiter waiter;
+
+      bool await_ready() {
+        return deadline <= Timer::system_time();
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        waiter.handle = handle;
+        scheduler.suspend(waiter, {}, deadline);
+      }
+
+      void await_resume()
+      {}
+    };
+    return Awaiter{ *this, deadline, Waiter() };
+  }
+
+  auto sleep(Timer::time_t duration) {
+    return sleep_until(Timer::system_time() + duration);
+  }
+
+  // until the signal is raised or the timeout runs out, false on timeout.
+  // the signal is not cleared
+  auto wait(const Signal &signal, Timer::time_t timeout=FOREVER) {
+    struct Awaiter {
+      Scheduler &scheduler;
+      const Signal &signal;
+      Timer::time_t deadline;
+      Waiter waiter;
+
+      bool await_ready() {
+        return signal.raised();
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        waiter.handle = handle;
+        scheduler.suspend(waiter, {signal.descriptor()}, deadline);
+      }
+
+      bool await_resume() {
+        return !waiter.timed_out;
+      }
+    };
+    const Timer::time_t deadline = (timeout == FOREVER) ? FOREVER : Timer::system_time() + timeout;
+    return Awaiter{ *this, signal, deadline, Waiter() };
+  }
+
+  // until a datagram of the channel may be waiting, the interrupt is raised or
+  // the timeout runs out, false on timeout. the other ready tasks run first
+  // either way. while datagrams wait for the socket to become writable it is
+  // watched for that as well, and they are sent again on resuming
+  template <typename S>
+  auto readable(S &socket, channel_t channel, Timer::time_t timeout=FOREVER, const Signal *interrupt=nullptr) {
+    struct Awaiter {
+      Scheduler &scheduler;
+      S &socket;
+      channel_t channel;
+      Timer::time_t deadline;
+      const Signal *interrupt;
+      Waiter waiter;
+
+      bool await_ready() {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        waiter.handle = handle;
+        if(socket.settle(channel) || (interrupt != nullptr && interrupt->raised())) {
+          scheduler.ready.push_back(handle);
+          return;
+        }
+        if(socket.backlog_depth() > 0) {
+          for(int fd : socket.writable_descriptors()) {
+            scheduler.watch(waiter, fd, EPOLLOUT);
+          }
+        }
+        std::vector<int> fds = socket.descriptors(channel);
+        if(interrupt != nullptr) {
+          fds.push_back(interrupt->descriptor());
+        }
+        scheduler.suspend(waiter, fds, deadline);
+      }
+
+      bool await_resume() {
+        if(socket.backlog_depth() > 0) {
+          socket.retry();
+        }
+        return !waiter.timed_out;
+      }
+    };
+    const Timer::time_t deadline = (timeout == FOREVER) ? FOREVER : Timer::system_time() + timeout;
+    return Awaiter{ *this, socket, channel, deadline, interrupt, Waiter() };
+  }
+
+  // passes the datagrams of the channel to handle while running() holds, up to
+  // BATCH_SIZE of them before after() is called and the other tasks get a
+  // turn. the interrupt wakes it up to find running() false
+  template <typename S, typename R, typename F, typename G>
+  Task<> serve(S &socket, channel_t channel, R running, F handle, G after, const Signal *interrupt=nullptr) {
+    while(running()) {
+      co_await readable(socket, channel, FOREVER, interrupt);
+      for(int i = 0; i < BATCH_SIZE && running(); ++i) {
+        if(!socket.receive_view(channel, handle)) {
+          break;
+        }
+      }
+      after();
+    }
+  }
+
+  // the next datagram of the channel, nothing if the timeout ran out first.
+  // it is copied out of the socket, loops that mind use readable() and
+  // receive_view() instead
+  template <typename S>
+  Task<std::optional<Blob>> receive(S &socket, channel_t channel, Timer::time_t timeout=FOREVER) {
+    const Timer::time_t deadline = (timeout == FOREVER) ? FOREVER : Timer::system_time() + timeout;
+    while(1) {
+      std::optional<Blob> blob = socket.receive(channel);
+      if(blob.has_value()) {
+        co_return blob;
+      }
+      Timer::time_t left = (deadline == FOREVER) ? FOREVER : deadline - Timer::system_time();
+      if(left <= .0 || !co_await readable(socket, channel, left)) {
+        co_return std::nullopt;
+      }
+    }
+  }
+};
+
+// the tasks of an actor, so that it can wait from another thread until they
+// all completed
+class TaskGroup {
+  // notified under the lock, so that the group is not gone before it is
+  std::mutex mtx;
+  std::condition_variable done;
+  int running = 0;
+
+  static Task<> track(TaskGroup &group, Task<> task) {
+    co_await std::move(task);
+    std::lock_guard<std::mutex> guard(group.mtx);
+    if(--group.running == 0) {
+      group.done.notify_all();
+    }
+  }
+public:
+  void spawn(Scheduler &scheduler, Task<> &&task) {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      ++running;
+    }
+    scheduler.spawn(track(*this, std::move(task)));
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> guard(mtx);
+    done.wait(guard, [this]() { return running == 0; });
+  }
+};
+
+// a scheduler running on a thread of its own for as long as it exists. the
+// actors which share a socket take turns on it
+class SchedulerThread {
+  Scheduler scheduler_;
+  std::thread thread;
+public:
+  SchedulerThread():
+    thread([this]() mutable {
+      scheduler_.run_until_stopped();
+    })
+  {}
+
+  ~SchedulerThread() {
+    scheduler_.stop();
+    thread.join();
+  }
+
+  Scheduler &scheduler() {
+    return scheduler_;
+  }
+};
+
+template <typename P>
+std::coroutine_handle<> detail::TaskPromiseBase::FinalAwaiter<P>::await_suspend(std::coroutine_handle<P> handle) noexcept {
+  TaskPromiseBase &promise = handle.promise();
+  if(promise.continuation) {
+    return promise.continuation;
+  }
+  if(promise.scheduler != nullptr) {
+    promise.scheduler->finished(handle, promise.exception);
+  }
+  return std::noop_coroutine();
+}
+
+}
@@ -12,7 +12,7 @@ struct Client {
   Intelligence<IntelligenceType::ABSTRACT> *intelligence = nullptr;
 
   template <typename... ArgTs>
-  Client(ArgTs... args):
+  Client(ArgTs &&... args):
     mclient(std::forward<ArgTs>(args)...)
   {}
 
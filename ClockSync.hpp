@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cmath>
+
+#include <deque>
+#include <algorithm>
+
+#include "Timer.hpp"
+
+namespace net {
+
+// estimates a remote clock from exchanges of four timestamps as in ntp: t0 the
+// request leaves, t1 it arrives remotely, t2 the reply leaves, t3 it arrives.
+// of the latest samples the one with the smallest round trip is trusted most,
+// since queueing only ever adds delay. the rate at which the offset changes
+// between trusted samples is smoothed into a drift
+class ClockSync {
+  struct Sample {
+    Timer::time_t local;
+    Timer::time_t rtt;
+    Timer::time_t offset;
+  };
+
+  static constexpr size_t WINDOW = 8;
+  // drift is only measured over intervals at least this long
+  static constexpr Timer::time_t MIN_DRIFT_INTERVAL = 1.;
+  static constexpr double DRIFT_GAIN = .125;
+  static constexpr double MAX_DRIFT = .05;
+
+  std::deque<Sample> samples;
+  bool synced_ = false;
+  // remote minus local time at local time ref
+  Timer::time_t offset_ = .0;
+  Timer::time_t ref = .0;
+  Timer::time_t rtt_ = .0;
+  double drift_ = .0;
+public:
+  ClockSync()
+  {}
+
+  void sample(Timer::time_t t0, Timer::time_t t1, Timer::time_t t2, Timer::time_t t3) {
+    Timer::time_t rtt = std::fmax((t3 - t0) - (t2 - t1), .0);
+    Timer::time_t offset = ((t1 - t0) + (t2 - t3)) / 2;
+    samples.push_back((Sample){ .local = t3, .rtt = rtt, .offset = offset });
+    if(samples.size() > WINDOW) {
+      samples.pop_front();
+    }
+    const Sample &best = *std::min_element(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) {
+      return a.rtt < b.rtt;
+    });
+    rtt_ = best.rtt;
+    if(!synced_) {
+      offset_ = best.offset, ref = best.local;
+      synced_ = true;
+      return;
+    }
+    if(best.local - ref < MIN_DRIFT_INTERVAL) {
+      return;
+    }
+    double drift = (best.offset - offset_) / (best.local - ref);
+    drift_ += DRIFT_GAIN * (drift - drift_);
+    drift_ = std::fmax(-MAX_DRIFT, std::fmin(drift_, MAX_DRIFT));
+    offset_ = best.offset, ref = best.local;
+  }
+
+  bool synced() const {
+    return synced_;
+  }
+
+  Timer::time_t offset(Timer::time_t local) const {
+    return offset_ + drift_ * (local - ref);
+  }
+
+  Timer::time_t to_remote(Timer::time_t local) const {
+    return local + offset(local);
+  }
+
+  Timer::time_t to_local(Timer::time_t remote) const {
+    return (remote - offset_ + drift_ * ref) / (1. + drift_);
+  }
+
+  Timer::time_t rtt() const {
+    return rtt_;
+  }
+
+  double drift() const {
+    return drift_;
+  }
+};
+
+}
@@ -1,16 +1,26 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 
 #include <algorithm>
+#include <bit>
 #include <set>
+#include <map>
 #include <queue>
+#include <optional>
 #include <thread>
 #include <mutex>
 #include <chrono>
 
 #include "Soccer.hpp"
 #include "Network.hpp"
+#include "Async.hpp"
+#include "Sessions.hpp"
+#include "Reliable.hpp"
+#include "ClockSync.hpp"
+#include "SendRate.hpp"
+#include "Serialize.hpp"
 #include "Logger.hpp"
 #include "Optimizations.hpp"
 
@@ -65,6 +75,8 @@ using SoccerRemote = Intelligence<IntelligenceType::REMOTE>;
 using SoccerComputer = Intelligence<IntelligenceType::COMPUTER>;
 
 namespace pkg {
+  constexpr net::channel_t MATCH_CHANNEL = 3;
+
   // listen/send action
   enum class Action : uint8_t { NO_ACTION,Z,X,C,V,F,S,M };
 
@@ -140,81 +152,774 @@ namespace pkg {
     constexpr bool operator!=(const sync_struct &other) const {
       return frame != other.frame;
     }
+    // of syncs at the same frame the one with an action comes first
     constexpr bool operator<(const sync_struct &other) const {
-      return frame < other.frame;
+      return frame < other.frame || (frame == other.frame && has_action() && !other.has_action());
     }
     constexpr bool operator>(const sync_struct &other) const {
-      return frame > other.frame;
+      return other < *this;
     }
   } ATTRIB_PACKED;
 };
 
+// also written into snapshots
+NET_FIELDS(pkg::vec3,
+  net::Field<&S::x, net::Float>,
+  net::Field<&S::y, net::Float>,
+  net::Field<&S::z, net::Float>)
+NET_FIELDS(pkg::action_struct,
+  net::Field<&S::a, net::Bits<3>>,
+  net::Field<&S::id, net::SBits<7>>,
+  net::Field<&S::dir, net::Float>,
+  net::Field<&S::dest, net::Nested>)
+
+namespace pkg {
+  // pitch half extents as drawn by PitchObject. positions are quantized
+  // relative to them, with room for units which leave the pitch
+  constexpr float PITCH_HALF_LENGTH = 1.80;
+  constexpr float PITCH_HALF_WIDTH = .95;
+
+  namespace quant {
+    constexpr float POS_X = 2 * PITCH_HALF_LENGTH / INT16_MAX;
+    constexpr float POS_Y = 2 * PITCH_HALF_WIDTH / INT16_MAX;
+    constexpr float POS_Z = Unit::GAUGE / 20;
+    constexpr float SPEED = Unit::GAUGE / 40;
+    constexpr float ANGLE = 2 * M_PI / 65536;
+    constexpr Timer::time_t FRAME = 1e-4;
+
+    inline int32_t to_fixed(float value, float step) {
+      return int32_t(std::fmax(INT16_MIN, std::fmin(INT16_MAX, std::round(value / step))));
+    }
+
+    inline int32_t to_angle(float angle) {
+      return uint16_t(std::lround(angle / ANGLE));
+    }
+
+    inline float from_angle(int32_t angle) {
+      return int16_t(uint16_t(angle)) * ANGLE;
+    }
+  }
+
+  // unit state of a sync_struct in fixed point. units are delta encoded
+  // field by field against an earlier snapshot of the same unit
+  enum SyncField : uint8_t {
+    POS_X, POS_Y, POS_Z, DEST_X, DEST_Y, MOVEMENT_SPEED, VERTICAL_SPEED,
+    ANGLE, ANGLE_DEST,
+    NO_SYNC_FIELDS
+  };
+
+  struct sync_state {
+    int32_t fields[NO_SYNC_FIELDS] = {};
+
+    sync_state()
+    {}
+
+    explicit sync_state(const sync_struct &sync) {
+      fields[POS_X] = quant::to_fixed(sync.pos.x, quant::POS_X);
+      fields[POS_Y] = quant::to_fixed(sync.pos.y, quant::POS_Y);
+      fields[POS_Z] = quant::to_fixed(sync.pos.z, quant::POS_Z);
+      fields[DEST_X] = quant::to_fixed(sync.dest.x, quant::POS_X);
+      fields[DEST_Y] = quant::to_fixed(sync.dest.y, quant::POS_Y);
+      fields[MOVEMENT_SPEED] = quant::to_fixed(sync.movement_speed, quant::SPEED);
+      fields[VERTICAL_SPEED] = quant::to_fixed(sync.vertical_speed, quant::SPEED);
+      fields[ANGLE] = quant::to_angle(sync.angle);
+      fields[ANGLE_DEST] = quant::to_angle(sync.angle_dest);
+    }
+
+    void unpack(sync_struct &sync) const {
+      sync.pos = pkg::vec3(fields[POS_X] * quant::POS_X, fields[POS_Y] * quant::POS_Y, fields[POS_Z] * quant::POS_Z);
+      sync.dest = pkg::vec2(fields[DEST_X] * quant::POS_X, fields[DEST_Y] * quant::POS_Y);
+      sync.movement_speed = fields[MOVEMENT_SPEED] * quant::SPEED;
+      sync.vertical_speed = fields[VERTICAL_SPEED] * quant::SPEED;
+      sync.angle = quant::from_angle(fields[ANGLE]);
+      sync.angle_dest = quant::from_angle(fields[ANGLE_DEST]);
+    }
+
+    // angles wrap around, so the shorter way is encoded
+    static constexpr int32_t delta(int field, int32_t value, int32_t base) {
+      if(field == ANGLE || field == ANGLE_DEST) {
+        return int16_t(uint16_t(value - base));
+      }
+      return value - base;
+    }
+
+    static constexpr int32_t apply(int field, int32_t base, int32_t delta) {
+      if(field == ANGLE || field == ANGLE_DEST) {
+        return uint16_t(base + delta);
+      }
+      return base + delta;
+    }
+  };
+
+  // wire format of a snapshot, integers in little endian:
+  //   seq, flags, frame, number of actions, ball owner
+  //   action_struct by its fields         if SNAPSHOT_HAS_ACTION
+  //   net::Ack by its fields              if SNAPSHOT_HAS_ACK
+  //   until the end, for every unit:
+  //     unit id, distance to its base snapshot (0 for none), field mask
+  //     svarint delta per masked field against the base or zero
+  // a world which does not fit is split over several snapshots
+  constexpr uint8_t SNAPSHOT_HAS_ACTION = 1 << 0;
+  constexpr uint8_t SNAPSHOT_HAS_ACK = 1 << 1;
+  // with room for the group, length and xor of lengths of a parity
+  constexpr size_t SNAPSHOT_CAPACITY = std::min<size_t>(UINT8_MAX, net::MAX_PACKET_SIZE - sizeof(net::Header) - 3 * sizeof(uint8_t));
+  // largest encoded unit: id, base, mask and every field changed by 17 bits
+  constexpr size_t SNAPSHOT_UNIT_SIZE = 1 + 3 + 2 + 3 * NO_SYNC_FIELDS;
+
+  struct snapshot_struct {
+    uint8_t len;
+    uint8_t bytes[SNAPSHOT_CAPACITY];
+
+    constexpr size_t size() const {
+      return sizeof(len) + len;
+    }
+  } ATTRIB_PACKED;
+
+  // xor of PARITY_GROUP consecutive snapshots, bytes past the end of a
+  // snapshot counting as zero. a client which lost one of them rebuilds it
+  // from the others and the parity
+  constexpr size_t PARITY_GROUP = 4;
+  static_assert((PARITY_GROUP & (PARITY_GROUP - 1)) == 0 && PARITY_GROUP < 8);
+
+  struct snapshot_parity_struct {
+    // the first snapshot's seq divided by PARITY_GROUP, truncated
+    uint8_t group;
+    uint8_t len_xor;
+    uint8_t len;
+    uint8_t bytes[SNAPSHOT_CAPACITY];
+
+    constexpr size_t size() const {
+      return sizeof(group) + sizeof(len_xor) + sizeof(len) + len;
+    }
+  } ATTRIB_PACKED;
+
+  // snapshots a client received, sent back so that the server knows what it
+  // can encode against
+  struct snapshot_ack_struct {
+    net::ReceiveWindow received;
+  } ATTRIB_PACKED;
+
+  // clock exchange in match time, t0 is echoed back by the server
+  struct clock_request_struct {
+    Timer::time_t t0;
+  } ATTRIB_PACKED;
+
+  struct clock_response_struct {
+    Timer::time_t t0;
+    Timer::time_t t1;
+    Timer::time_t t2;
+  } ATTRIB_PACKED;
+
+  // match time advances with the frames of the game loop. in between frames it
+  // is carried on by the system clock, so that clock exchanges are stamped
+  // exactly
+  class MatchClock {
+    std::mutex mtx;
+    Timer::time_t frame = .0;
+    Timer::time_t frame_system = -1.;
+  public:
+    MatchClock()
+    {}
+
+    void set(Timer::time_t t) {
+      std::lock_guard<std::mutex> guard(mtx);
+      frame = t;
+      frame_system = Timer::system_time();
+    }
+
+    Timer::time_t now() {
+      return at(Timer::system_time());
+    }
+
+    // match time at a point in Timer::system_time()
+    Timer::time_t at(Timer::time_t systime) {
+      std::lock_guard<std::mutex> guard(mtx);
+      if(frame_system < .0) {
+        return frame;
+      }
+      return frame + systime - frame_system;
+    }
+  };
+
+  constexpr size_t SNAPSHOT_HISTORY = 64;
+
+  // units of a snapshot in the history of either side
+  struct snapshot_entry {
+    net::seq_t seq = 0;
+    bool valid = false;
+    std::vector<std::pair<int8_t, sync_state>> units;
+    net::Ack ack;
+
+    const sync_state *find(int8_t id) const {
+      for(const auto &[unit_id, state] : units) {
+        if(unit_id == id) {
+          return &state;
+        }
+      }
+      return nullptr;
+    }
+  };
+
+  // server side, one per client. every unit is encoded against its newest
+  // snapshot the client acknowledged which is still in the history
+  class SnapshotEncoder {
+    net::seq_t next_seq = 0;
+    snapshot_entry sent[SNAPSHOT_HISTORY];
+    std::map<int8_t, net::seq_t> baselines;
+    // the action ack is only sent again once it changes
+    std::optional<std::pair<net::seq_t, net::Ack>> acked_ack;
+
+    const snapshot_entry *find(net::seq_t seq) const {
+      const snapshot_entry &e = sent[seq % SNAPSHOT_HISTORY];
+      return (e.valid && e.seq == seq) ? &e : nullptr;
+    }
+
+    const sync_state *base_of(int8_t id, net::seq_t &base_seq) const {
+      auto it = baselines.find(id);
+      if(it == std::end(baselines)) {
+        return nullptr;
+      }
+      const snapshot_entry *e = find(it->second);
+      base_seq = it->second;
+      return e ? e->find(id) : nullptr;
+    }
+  public:
+    SnapshotEncoder()
+    {}
+
+    // frame, number of actions, ball owner and action are taken from the
+    // first unit. send_func(snapshot) is called for every fragment. with
+    // changed_only, units the client has as they are are left out, except the
+    // first
+    template <typename F>
+    void encode(const std::vector<sync_struct> &units, const net::Ack &ack, F &&send_func, bool changed_only=false) {
+      ASSERT(!units.empty());
+      const sync_struct &first = units.front();
+
+      snapshot_struct snapshot;
+      net::ByteWriter w(snapshot.bytes, sizeof(snapshot.bytes));
+      snapshot_entry *entry = nullptr;
+      auto begin = [&]() mutable {
+        const net::seq_t seq = next_seq++;
+        entry = &sent[seq % SNAPSHOT_HISTORY];
+        entry->seq = seq, entry->valid = true, entry->ack = ack;
+        entry->units.clear();
+
+        uint8_t flags = 0;
+        if(first.has_action()) flags |= SNAPSHOT_HAS_ACTION;
+        if(!acked_ack.has_value() || memcmp(&acked_ack->second, &ack, sizeof(net::Ack))) flags |= SNAPSHOT_HAS_ACK;
+        w = net::ByteWriter(snapshot.bytes, sizeof(snapshot.bytes));
+        w.put<net::seq_t>(seq);
+        w.put<uint8_t>(flags);
+        w.put_varint(uint32_t(std::lround(first.frame / quant::FRAME)));
+        w.put_varint(first.no_actions);
+        w.put<int8_t>(first.ball_owner);
+        if(flags & SNAPSHOT_HAS_ACTION) {
+          w.put_fields(first.action);
+        }
+        if(flags & SNAPSHOT_HAS_ACK) {
+          w.put_fields(ack);
+        }
+      };
+      auto end = [&]() mutable {
+        ASSERT(w.ok());
+        snapshot.len = w.size();
+        send_func(snapshot);
+      };
+
+      begin();
+      for(const auto &unit : units) {
+        const sync_state state(unit);
+        net::seq_t base_seq = 0;
+        const sync_state *base = base_of(unit.id, base_seq);
+        const sync_state zero;
+        const sync_state &from = base ? *base : zero;
+
+        uint32_t mask = 0;
+        for(int i = 0; i < NO_SYNC_FIELDS; ++i) {
+          if(state.fields[i] != from.fields[i]) {
+            mask |= 1 << i;
+          }
+        }
+        if(changed_only && base != nullptr && mask == 0 && &unit != &first) {
+          continue;
+        }
+        // a fragment is only begun for a unit which goes into it
+        if(w.size() + SNAPSHOT_UNIT_SIZE > sizeof(snapshot.bytes)) {
+          end();
+          begin();
+        }
+        w.put<int8_t>(unit.id);
+        w.put_varint(base ? net::seq_distance(base_seq, entry->seq) : 0);
+        w.put_varint(mask);
+        for(int i = 0; i < NO_SYNC_FIELDS; ++i) {
+          if(mask & (1 << i)) {
+            w.put_svarint(sync_state::delta(i, state.fields[i], from.fields[i]));
+          }
+        }
+        entry->units.push_back({unit.id, state});
+      }
+      end();
+    }
+
+    void acknowledge(const net::ReceiveWindow &received) {
+      for(net::seq_t d = 0; d <= net::ReceiveWindow::WINDOW; ++d) {
+        const net::seq_t seq = received.latest - d;
+        const snapshot_entry *e = find(seq);
+        if(!received.contains(seq) || e == nullptr) {
+          continue;
+        }
+        for(const auto &[id, state] : e->units) {
+          auto it = baselines.find(id);
+          if(it == std::end(baselines) || find(it->second) == nullptr || net::seq_before(it->second, seq)) {
+            baselines[id] = seq;
+          }
+        }
+        if(!acked_ack.has_value() || net::seq_before(acked_ack->first, seq)) {
+          acked_ack = std::make_pair(seq, e->ack);
+        }
+      }
+    }
+  };
+
+  // client side counterpart of SnapshotEncoder
+  class SnapshotDecoder {
+    snapshot_entry received[SNAPSHOT_HISTORY];
+    net::ReceiveWindow window_;
+  public:
+    SnapshotDecoder()
+    {}
+
+    // everything before the units
+    static net::seq_t decode_header(net::ByteReader &r, sync_struct &sync, std::optional<net::Ack> &ack) {
+      const net::seq_t seq = r.get<net::seq_t>();
+      const uint8_t flags = r.get<uint8_t>();
+      sync.frame = r.get_varint() * quant::FRAME;
+      sync.no_actions = r.get_varint();
+      sync.ball_owner = r.get<int8_t>();
+      if(flags & SNAPSHOT_HAS_ACTION) {
+        sync.action = r.get_fields<action_struct>();
+      }
+      ack.reset();
+      if(flags & SNAPSHOT_HAS_ACK) {
+        ack = r.get_fields<net::Ack>();
+      }
+      return seq;
+    }
+
+    // appends the units of a snapshot. fails on duplicates and on snapshots
+    // which can not be decoded
+    bool decode(const snapshot_struct &snapshot, std::vector<sync_struct> &units, std::optional<net::Ack> &ack) {
+      net::ByteReader r(snapshot.bytes, std::min<size_t>(snapshot.len, sizeof(snapshot.bytes)));
+      sync_struct sync;
+      const net::seq_t seq = decode_header(r, sync, ack);
+      if(!r.ok() || window_.contains(seq)) {
+        return false;
+      }
+
+      snapshot_entry entry;
+      entry.seq = seq, entry.valid = true;
+      while(r.ok() && r.remaining() > 0) {
+        const int8_t id = r.get<int8_t>();
+        const net::seq_t base_dist = r.get_varint();
+        const uint32_t mask = r.get_varint();
+
+        sync_state state;
+        if(base_dist != 0) {
+          const net::seq_t base_seq = seq - base_dist;
+          const snapshot_entry &e = received[base_seq % SNAPSHOT_HISTORY];
+          const sync_state *base = (e.valid && e.seq == base_seq) ? e.find(id) : nullptr;
+          if(base == nullptr) {
+            Logger::Warning("iclient: snapshot %hu refers to unknown base %hu\n", seq, base_seq);
+            return false;
+          }
+          state = *base;
+        }
+        for(int i = 0; i < NO_SYNC_FIELDS; ++i) {
+          if(mask & (1 << i)) {
+            state.fields[i] = sync_state::apply(i, state.fields[i], r.get_svarint());
+          }
+        }
+        entry.units.push_back({id, state});
+      }
+      if(!r.ok()) {
+        Logger::Warning("iclient: malformed snapshot %hu\n", seq);
+        return false;
+      }
+
+      for(const auto &[id, state] : entry.units) {
+        sync.id = id;
+        state.unpack(sync);
+        units.push_back(sync);
+        // only the acting unit carries the action
+        sync.action.a = Action::NO_ACTION;
+      }
+      received[seq % SNAPSHOT_HISTORY] = std::move(entry);
+      window_.mark(seq);
+      return true;
+    }
+
+    const net::ReceiveWindow &window() const {
+      return window_;
+    }
+  };
+
+  inline net::seq_t snapshot_seq(const snapshot_struct &snapshot) {
+    return net::ByteReader(snapshot.bytes, std::min<size_t>(snapshot.len, sizeof(snapshot.bytes))).get<net::seq_t>();
+  }
+
+  // a bit per unit in a fragment. a queued fragment is only stale once a
+  // newer one carries the same units, one with an action never is
+  inline std::optional<uint32_t> snapshot_units(const snapshot_struct &snapshot) {
+    net::ByteReader r(snapshot.bytes, std::min<size_t>(snapshot.len, sizeof(snapshot.bytes)));
+    sync_struct sync;
+    std::optional<net::Ack> ack;
+    SnapshotDecoder::decode_header(r, sync, ack);
+    if(sync.has_action()) {
+      return std::nullopt;
+    }
+    uint32_t units = 0;
+    while(r.ok() && r.remaining() > 0) {
+      const int8_t id = r.get<int8_t>();
+      r.get_varint();
+      const uint32_t mask = r.get_varint();
+      for(int i = 0; i < NO_SYNC_FIELDS; ++i) {
+        if(mask & (1 << i)) {
+          r.get_svarint();
+        }
+      }
+      if(id < -1 || id > 30) {
+        return std::nullopt;
+      }
+      units |= uint32_t(1) << (id + 1);
+    }
+    if(!r.ok()) {
+      return std::nullopt;
+    }
+    return units;
+  }
+
+  inline void xor_snapshot(snapshot_parity_struct &parity, uint8_t len, const uint8_t *bytes) {
+    len = std::min<size_t>(len, sizeof(parity.bytes));
+    for(size_t i = 0; i < len; ++i) {
+      parity.bytes[i] ^= bytes[i];
+    }
+    parity.len = std::max(parity.len, len);
+  }
+
+  // server side, one per client next to its SnapshotEncoder, whose seqs
+  // start at a group and have no gaps
+  class ParityEncoder {
+    snapshot_parity_struct parity;
+  public:
+    ParityEncoder()
+    {}
+
+    // send_func(parity) is called after the last snapshot of every group
+    template <typename F>
+    void add(const snapshot_struct &snapshot, F &&send_func) {
+      const net::seq_t seq = snapshot_seq(snapshot);
+      if(seq % PARITY_GROUP == 0) {
+        memset(&parity, 0x00, sizeof(parity));
+        parity.group = uint8_t(seq / PARITY_GROUP);
+      }
+      parity.len_xor ^= snapshot.len;
+      xor_snapshot(parity, snapshot.len, snapshot.bytes);
+      if(seq % PARITY_GROUP == PARITY_GROUP - 1) {
+        send_func(parity);
+      }
+    }
+  };
+
+  // client side counterpart. keeps the xor of everything that arrived of the
+  // last few groups, which is the missing snapshot once all but one did
+  class ParityDecoder {
+    static constexpr size_t HISTORY = 4;
+    // a bit per snapshot of the group and one for the parity
+    static constexpr uint8_t PARITY_BIT = 1 << PARITY_GROUP;
+    static constexpr uint8_t ALL_BITS = (PARITY_BIT << 1) - 1;
+
+    struct Group {
+      bool valid = false;
+      uint8_t received = 0;
+      snapshot_parity_struct sum;
+    };
+    Group groups[HISTORY];
+
+    // null for groups older than the history
+    Group *find(uint8_t group) {
+      Group &g = groups[group % HISTORY];
+      if(g.valid && g.sum.group == group) {
+        return &g;
+      }
+      if(g.valid && int8_t(group - g.sum.group) < 0) {
+        return nullptr;
+      }
+      g.valid = true;
+      g.received = 0;
+      memset(&g.sum, 0x00, sizeof(g.sum));
+      g.sum.group = group;
+      return &g;
+    }
+
+    std::optional<snapshot_struct> add(Group *g, uint8_t bit, uint8_t len_xor, uint8_t len, const uint8_t *bytes) {
+      if(g == nullptr || (g->received & bit)) {
+        return std::nullopt;
+      }
+      g->received |= bit;
+      g->sum.len_xor ^= len_xor;
+      xor_snapshot(g->sum, len, bytes);
+      if(g->received == ALL_BITS || std::popcount(g->received) != PARITY_GROUP || !(g->received & PARITY_BIT)) {
+        return std::nullopt;
+      }
+      g->received = ALL_BITS;
+      snapshot_struct snapshot;
+      snapshot.len = g->sum.len_xor;
+      if(snapshot.len > sizeof(snapshot.bytes)) {
+        return std::nullopt;
+      }
+      memcpy(snapshot.bytes, g->sum.bytes, snapshot.len);
+      return snapshot;
+    }
+  public:
+    ParityDecoder()
+    {}
+
+    // the snapshot rebuilt with the one that arrived, if any
+    std::optional<snapshot_struct> add(const snapshot_struct &snapshot) {
+      const net::seq_t seq = snapshot_seq(snapshot);
+      return add(find(uint8_t(seq / PARITY_GROUP)), 1 << (seq % PARITY_GROUP), snapshot.len, snapshot.len, snapshot.bytes);
+    }
+
+    std::optional<snapshot_struct> add(const snapshot_parity_struct &parity) {
+      return add(find(parity.group), PARITY_BIT, parity.len_xor, parity.len, parity.bytes);
+    }
+  };
+};
+
+NET_MESSAGE(pkg::action_struct, 0x30, 1)
+NET_MESSAGE_VARIABLE(pkg::snapshot_struct, 0x31, 5)
+NET_MESSAGE(net::Reliable<pkg::action_struct>, 0x32, 1)
+NET_MESSAGE(pkg::snapshot_ack_struct, 0x33, 1)
+NET_MESSAGE(pkg::clock_request_struct, 0x34, 1)
+NET_MESSAGE(pkg::clock_response_struct, 0x35, 1)
+NET_MESSAGE_VARIABLE(pkg::snapshot_parity_struct, 0x36, 2)
+NET_SESSION_MESSAGES(pkg::MATCH_CHANNEL)
+
+NET_FIELDS(pkg::snapshot_struct,
+  net::Bytes<&S::len, &S::bytes>)
+NET_FIELDS(pkg::snapshot_parity_struct,
+  net::Field<&S::group, net::Bits<8>>,
+  net::Field<&S::len_xor, net::Bits<8>>,
+  net::Bytes<&S::len, &S::bytes>)
+NET_FIELDS(pkg::snapshot_ack_struct,
+  net::Field<&S::received, net::Nested>)
+NET_FIELDS(pkg::clock_request_struct,
+  net::Field<&S::t0, net::Float>)
+NET_FIELDS(pkg::clock_response_struct,
+  net::Field<&S::t0, net::Float>,
+  net::Field<&S::t1, net::Float>,
+  net::Field<&S::t2, net::Float>)
+// superseded by the next snapshot, ack or clock probe. actions never are
+NET_DROPPABLE(pkg::snapshot_struct)
+NET_DROPPABLE_KEY(pkg::snapshot_struct, pkg::snapshot_units)
+NET_DROPPABLE(pkg::snapshot_parity_struct)
+NET_DROPPABLE_KEY(pkg::snapshot_parity_struct, [](const pkg::snapshot_parity_struct &parity) { return parity.group; })
+NET_DROPPABLE(pkg::snapshot_ack_struct)
+NET_DROPPABLE(pkg::clock_request_struct)
+NET_DROPPABLE(pkg::clock_response_struct)
+
 template <>
 struct Intelligence<IntelligenceType::SERVER> : public Intelligence<IntelligenceType::ABSTRACT> {
   int8_t id_;
   int no_actions = 0;
   Soccer &soccer;
   net::Socket<net::SocketType::UDP> &socket;
-  std::thread server_thread;
+  net::Scheduler &scheduler;
+  net::TaskGroup tasks;
+  // raised while the server is not running
+  net::Signal stopping;
   std::recursive_mutex no_actions_mtx;
-  std::recursive_mutex finalize_mtx;
 
+  // the clients are known from the lobby, their sessions are open from the
+  // start and only handed out on request
+  struct Peer {
+    net::ReliableReceiver<pkg::action_struct> actions;
+    pkg::SnapshotEncoder snapshots;
+    pkg::ParityEncoder parity;
+    net::SendRate rate;
+    Timer::time_t next_sync = .0;
+  };
   std::set<net::Addr> clients;
+  net::Sessions<Peer> peers;
+  pkg::MatchClock clock;
 
-  Intelligence(int id, Soccer &soccer, net::Socket<net::SocketType::UDP> &socket, std::set<net::Addr> clients):
+  // what is synced every tick: the whole world or a random unit
+  enum class SyncMode {
+    WORLD, UNIT
+  };
+  SyncMode sync_mode = SyncMode::WORLD;
+  // a parity after every few snapshots, so that clients on lossy links
+  // rebuild a lost one instead of waiting for the next
+  bool send_parity = true;
+  // every client is synced at its own rate, checked every tick. below
+  // FULL_DETAIL_RATE it only gets the units which changed
+  static constexpr Timer::time_t SYNC_TICK = 1. / net::SendRate::MAX_RATE;
+  static constexpr double FULL_DETAIL_RATE = 20.;
+
+  Intelligence(int id, Soccer &soccer, net::Socket<net::SocketType::UDP> &socket, net::Scheduler &scheduler, std::set<net::Addr> clients):
     id_(id), soccer(soccer),
-    socket(socket), clients(clients)
-  {}
+    socket(socket), scheduler(scheduler),
+    stopping(true), clients(clients)
+  {
+    for(const auto &addr : clients) {
+      peers.open(addr);
+    }
+  }
 
-  static void run(SoccerServer *server) {
-    constexpr int EVENT_SYNC = 1;
-    Timer timer;
-    timer.set_time(Timer::system_time());
-    timer.set_timeout(EVENT_SYNC, .1);
-    server->socket.listen(
-      [&]() mutable {
-        if(server->has_quit()) {
-          return !server->should_stop();
-        }
-        // send sync data for random unit showing that no action occured until a
-        // certain time point
-        Timer::time_t server_time = Timer::system_time();
-        timer.set_time(server_time);
-        if(timer.timed_out(EVENT_SYNC)) {
-          timer.set_event(EVENT_SYNC);
-          std::lock_guard<std::recursive_mutex> guard(server->soccer.mtx);
-          int no_ids = server->soccer.team1.size() + server->soccer.team2.size() + 1;
-          int8_t unit_id = (rand() % no_ids) - 1;
-          for(const auto &addr : server->clients) {
-            server->socket.send(net::make_package(addr, server->get_sync_data(unit_id)));
-          }
-        }
-        return !server->should_stop();
-      },
-      [&](const net::Blob &blob) {
-        // discard packages not belonging to current players
-        if(server->has_quit() || server->clients.find(blob.addr) == std::end(server->clients)) {
-          return !server->should_stop();
-        }
-        // if this package seems to be action, perform action and send responses
-        blob.try_visit_as<pkg::action_struct>([&](const auto action) mutable {
-          server->perform_action(action);
+  // send sync data showing that no action occured until a certain time point
+  net::Task<> send_syncs() {
+    Timer::time_t next_tick = Timer::system_time();
+    while(!should_stop()) {
+      co_await scheduler.sleep_until(next_tick);
+      const Timer::time_t server_time = Timer::system_time();
+      // late ticks are not made up for
+      next_tick = std::fmax(next_tick + SYNC_TICK, server_time);
+      if(has_quit()) {
+        continue;
+      }
+      sync(server_time);
+      socket.flush();
+    }
+  }
+
+  void handle(const net::BlobView &blob) {
+    // discard packages not belonging to current players
+    const net::session_t session = peers.identify(blob);
+    Peer *peer = peers.get(session);
+    if(has_quit() || peer == nullptr) {
+      return;
+    }
+    const Timer::time_t received = clock.at(blob.arrived());
+    net::Protocol<
+      net::Reliable<pkg::action_struct>,
+      pkg::snapshot_ack_struct,
+      pkg::clock_request_struct,
+      net::session_request_struct<pkg::MATCH_CHANNEL>
+    >::dispatch(blob,
+      // actions are performed in the order the client sent them, each once
+      [&](const auto &packet) mutable {
+        int delivered = peer->actions.receive(packet, [&](const pkg::action_struct &action) mutable {
+          perform_action(action);
           {
-            std::lock_guard<std::recursive_mutex> guard(server->no_actions_mtx);
-            ++server->no_actions;
+            std::lock_guard<std::recursive_mutex> guard(no_actions_mtx);
+            ++no_actions;
           }
           {
-            std::lock_guard<std::recursive_mutex> guard(server->soccer.mtx);
-            for(const auto &addr : server->clients) {
-              server->socket.send(net::make_package(addr, server->get_sync_data(action.id)));
-            }
+            std::lock_guard<std::recursive_mutex> guard(soccer.mtx);
+            // clients perform the action when they reach this sync
+            pkg::sync_struct sync = get_sync_data(action.id);
+            sync.action = action;
+            broadcast({sync});
           }
         });
-        return !server->should_stop();
+        // a duplicate or an action behind a gap, the client still needs
+        // to know what has arrived
+        if(delivered == 0) {
+          send_sync(blob.addr, *peer, {get_sync_data(packet.data.id)});
+        }
+      },
+      // the client tells which snapshots can be used as delta base
+      [&](const auto &ack) mutable {
+        peer->snapshots.acknowledge(ack.received);
+        peer->rate.acknowledge(ack.received, blob.arrived());
+        socket.metrics().rate(blob.addr.ip, blob.addr.port, peer->rate.estimate());
+      },
+      // answered right away rather than bundled, so that t2 is exact
+      [&](const auto &request) mutable {
+        socket.send(net::make_package(blob.addr, (pkg::clock_response_struct){
+          .t0 = request.t0,
+          .t1 = received,
+          .t2 = clock.now()
+        }));
+      },
+      [&](const auto &) mutable {
+        socket.send(net::make_package(blob.addr, (net::session_struct<pkg::MATCH_CHANNEL>){
+          .session = session
+        }));
       }
     );
   }
 
+  // sync data showing that no action occured until now, for the clients
+  // whose turn it is. each client is slowed down by its own losses and
+  // queueing only
+  void sync(Timer::time_t now) {
+    std::lock_guard<std::recursive_mutex> guard(soccer.mtx);
+    std::vector<pkg::sync_struct> units;
+    peers.each([&](net::session_t, const net::Addr &addr, Peer &peer) mutable {
+      peer.rate.update(now);
+      if(now < peer.next_sync) {
+        return;
+      }
+      // late ticks are not made up for
+      peer.next_sync = std::fmax(peer.next_sync + peer.rate.interval(), now);
+      if(sync_mode == SyncMode::UNIT) {
+        int no_ids = soccer.team1.size() + soccer.team2.size() + 1;
+        int8_t unit_id = (rand() % no_ids) - 1;
+        send_sync(addr, peer, {get_sync_data(unit_id)});
+        return;
+      }
+      if(units.empty()) {
+        units = get_world_data();
+      }
+      send_sync(addr, peer, units, peer.rate.rate() < FULL_DETAIL_RATE);
+    });
+  }
+
+  // bundled per client, sent out at the end of the tick. every client gets
+  // the acknowledgement of its own actions
+  void broadcast(const std::vector<pkg::sync_struct> &units) {
+    peers.each([&](net::session_t, const net::Addr &addr, Peer &peer) mutable {
+      send_sync(addr, peer, units);
+    });
+  }
+
+  void send_sync(const net::Addr &addr, Peer &peer, const std::vector<pkg::sync_struct> &units, bool changed_only=false) {
+    const Timer::time_t now = Timer::system_time();
+    std::vector<pkg::snapshot_parity_struct> parities;
+    peer.snapshots.encode(units, peer.actions.ack(), [&](const pkg::snapshot_struct &snapshot) mutable {
+      socket.bundle(net::make_package(addr, snapshot));
+      peer.rate.sent(pkg::snapshot_seq(snapshot), snapshot.size(), now);
+      if(send_parity) {
+        // one lost datagram may only take one member of a group with it
+        socket.flush(addr);
+        peer.parity.add(snapshot, [&](const pkg::snapshot_parity_struct &parity) mutable {
+          parities.push_back(parity);
+        });
+      }
+    }, changed_only);
+    // in a datagram of its own, so that it is not lost with the snapshots,
+    // and after them, so that it does not arrive before its group is complete
+    if(!parities.empty()) {
+      for(const auto &parity : parities) {
+        socket.send(net::make_package(addr, parity));
+      }
+    }
+  }
+
+  // the ball and every player at the same frame
+  std::vector<pkg::sync_struct> get_world_data() {
+    std::lock_guard<std::recursive_mutex> guard(soccer.mtx);
+    int no_players = soccer.team1.size() + soccer.team2.size();
+    std::vector<pkg::sync_struct> units;
+    units.reserve(no_players + 1);
+    for(int unit_id = Ball::NO_OWNER; unit_id < no_players; ++unit_id) {
+      units.push_back(get_sync_data(unit_id));
+    }
+    return units;
+  }
+
   pkg::sync_struct get_sync_data(int unit_id=Ball::NO_OWNER) {
     pkg::sync_struct usd;
     std::lock_guard<std::recursive_mutex> guard(soccer.mtx);
@@ -254,6 +959,7 @@ struct Intelligence<IntelligenceType::SERVER> : public Intelligence<Intelligence
   }
 
   void idle(Timer::time_t curtime) {
+    clock.set(curtime);
     soccer.idle(curtime);
   }
 
@@ -261,25 +967,27 @@ struct Intelligence<IntelligenceType::SERVER> : public Intelligence<Intelligence
     return id_;
   }
 
-  bool finalize = true;
   void start() {
     Logger::Info("iserver: started\n");
     ASSERT(should_stop());
-    finalize = false;
-    server_thread = std::thread(SoccerServer::run, this);
+    stopping.clear();
+    socket.accept_from(pkg::MATCH_CHANNEL, clients);
+    tasks.spawn(scheduler, scheduler.serve(socket, pkg::MATCH_CHANNEL,
+      [this]() { return !should_stop(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      [this]() { socket.flush(); },
+      &stopping));
+    tasks.spawn(scheduler, send_syncs());
   }
   void stop() {
     ASSERT(!should_stop());
-    {
-      std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-      finalize = true;
-    }
-    server_thread.join();
+    stopping.raise();
+    tasks.wait();
+    socket.accept_all(pkg::MATCH_CHANNEL);
     Logger::Info("iserver: finished\n");
   }
   bool should_stop() {
-    std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-    return finalize;
+    return stopping.raised();
   }
 
   void z_action() {
@@ -319,40 +1027,129 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
   net::Socket<net::SocketType::UDP> &socket;
   int no_actions = 0;
   Timer::time_t last_frame = Timer::time_start();
-  std::thread client_thread;
+  net::Scheduler &scheduler;
+  net::TaskGroup tasks;
+  // raised while the client is not running
+  net::Signal stopping;
   std::recursive_mutex frame_schedule_mtx;
-  std::recursive_mutex finalize_mtx;
+  net::ReliableSender<pkg::action_struct> actions;
+  std::recursive_mutex actions_mtx;
+  pkg::SnapshotDecoder snapshots;
+  pkg::ParityDecoder parity;
+  // decoded into by receive_snapshot, and the window last acknowledged
+  std::vector<pkg::sync_struct> units;
+  std::optional<net::Ack> ack;
+  net::ReceiveWindow acknowledged;
+  pkg::MatchClock clock;
+  net::ClockSync server_clock;
+  std::recursive_mutex server_clock_mtx;
 
-  Intelligence(int id, Soccer &soccer, net::Socket<net::SocketType::UDP> &socket, net::Addr server_addr):
+  // the clock is probed quickly until its window is full, then steadily
+  static constexpr int NO_FAST_PROBES = 8;
+  static constexpr Timer::time_t FAST_PROBE_INTERVAL = .1;
+  static constexpr Timer::time_t PROBE_INTERVAL = .5;
+
+  Intelligence(int id, Soccer &soccer, net::Socket<net::SocketType::UDP> &socket, net::Scheduler &scheduler, net::Addr server_addr):
     id_(id),
     soccer(soccer),
     server_addr(server_addr),
-    socket(socket)
+    socket(socket),
+    scheduler(scheduler),
+    stopping(true)
   {}
 
-  static void run(SoccerRemote *client) {
-    Timer::time_t delay = 1.;
-    client->socket.listen(
-      [&]() mutable {
-        return !client->should_stop();
+  // the clock, and the session until it arrives, are asked for quickly at
+  // first and steadily later. actions are resent here when no snapshots come
+  net::Task<> probe() {
+    Timer::time_t next_probe = Timer::system_time();
+    int no_probes = 0;
+    while(!should_stop()) {
+      Timer::time_t now = Timer::system_time();
+      if(now >= next_probe) {
+        if(socket.session_of(server_addr, pkg::MATCH_CHANNEL) == net::NO_SESSION) {
+          socket.send(net::make_package(server_addr, net::session_request_struct<pkg::MATCH_CHANNEL>()));
+        }
+        socket.send(net::make_package(server_addr, (pkg::clock_request_struct){ .t0 = clock.now() }));
+        ++no_probes;
+        next_probe = now + ((no_probes < NO_FAST_PROBES) ? FAST_PROBE_INTERVAL : PROBE_INTERVAL);
+      }
+      tick();
+      Timer::time_t wake = next_probe;
+      {
+        std::lock_guard<std::recursive_mutex> guard(actions_mtx);
+        wake = std::fmin(wake, now + actions.time_left(now));
+      }
+      co_await scheduler.wait(stopping, wake - Timer::system_time());
+    }
+  }
+
+  // resends the actions which are due and acknowledges the snapshots received
+  // since the last tick
+  void tick() {
+    std::lock_guard<std::recursive_mutex> guard(actions_mtx);
+    actions.retransmit(Timer::system_time(), [&](const auto &packet) mutable {
+      socket.send(net::make_package(server_addr, packet));
+    });
+    const net::ReceiveWindow &received = snapshots.window();
+    if(memcmp(&received, &acknowledged, sizeof(net::ReceiveWindow))) {
+      acknowledged = received;
+      socket.send(net::make_package(server_addr, (pkg::snapshot_ack_struct){ .received = received }));
+    }
+  }
+
+  void handle(const net::BlobView &blob) {
+    if(has_quit() || blob.addr != server_addr) {
+      return;
+    }
+    const Timer::time_t arrived = blob.arrived();
+    const Timer::time_t received = clock.at(arrived);
+    net::Protocol<
+      pkg::snapshot_struct,
+      pkg::snapshot_parity_struct,
+      pkg::clock_response_struct,
+      net::session_struct<pkg::MATCH_CHANNEL>
+    >::dispatch(blob,
+      // receive package sync
+      [&](const auto &snapshot) mutable {
+        receive_snapshot(snapshot, arrived);
+        // the one lost of its group, if this completes it
+        if(auto rebuilt = parity.add(snapshot)) {
+          receive_snapshot(rebuilt.value(), arrived);
+        }
       },
-      [&](const net::Blob &blob) mutable {
-        if(client->has_quit() || blob.addr != client->server_addr) {
-          return !client->should_stop();
+      [&](const auto &parity_data) mutable {
+        if(auto rebuilt = parity.add(parity_data)) {
+          receive_snapshot(rebuilt.value(), arrived);
         }
-        // receive package sync
-        blob.try_visit_as<pkg::sync_struct>([&](const auto &sync) mutable {
-          std::lock_guard<std::recursive_mutex> guard(client->frame_schedule_mtx);
-          client->frame_schedule.push(sync);
-          std::lock_guard<std::recursive_mutex> sguard(client->soccer.mtx);
-          Timer::time_t current_time = client->soccer.timer.current_time;
-          delay = current_time - sync.frame;
-        });
-        return !client->should_stop();
+      },
+      [&](const auto &response) mutable {
+        std::lock_guard<std::recursive_mutex> guard(server_clock_mtx);
+        server_clock.sample(response.t0, response.t1, response.t2, received);
+      },
+      [&](const auto &response) mutable {
+        socket.set_session(server_addr, pkg::MATCH_CHANNEL, response.session);
       }
     );
   }
 
+  void receive_snapshot(const pkg::snapshot_struct &snapshot, Timer::time_t arrived) {
+    units.clear();
+    if(!snapshots.decode(snapshot, units, ack) || units.empty()) {
+      return;
+    }
+    if(ack.has_value()) {
+      std::lock_guard<std::recursive_mutex> guard(actions_mtx);
+      actions.acknowledge(ack.value(), arrived, [&](Timer::time_t rtt) mutable {
+        socket.metrics().rtt(server_addr.ip, server_addr.port, rtt);
+      });
+    }
+    std::lock_guard<std::recursive_mutex> guard(frame_schedule_mtx);
+    for(auto &sync : units) {
+      sync.frame = to_local(sync.frame);
+      frame_schedule.push(sync);
+    }
+  }
+
   std::priority_queue<
     pkg::sync_struct,
     std::vector<pkg::sync_struct>,
@@ -361,6 +1158,9 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
 
   std::queue<Timer::time_t> frames;
   static constexpr size_t FRAMERATE = 48;
+  // how long syncs with missing actions before them are held back for the
+  // actions to arrive late
+  static constexpr Timer::time_t RESYNC_DELAY = .1;
 
   void process_frames(Timer::time_t max_frame) {
     /* printf("  processing frames up to %f\n", max_frame); */
@@ -415,7 +1215,18 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
     unpack_sync_action(sync);
   }
 
+  // the local match time at which the server was at server_time, the same
+  // time until the first clock exchange came back
+  Timer::time_t to_local(Timer::time_t server_time) {
+    std::lock_guard<std::recursive_mutex> guard(server_clock_mtx);
+    if(!server_clock.synced()) {
+      return server_time;
+    }
+    return server_clock.to_local(server_time);
+  }
+
   void idle(Timer::time_t curtime) {
+    clock.set(curtime);
     if(curtime <= Timer::time_start())return;
 
     constexpr Timer::time_t max_framediff = 1. / FRAMERATE;
@@ -433,6 +1244,11 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
       next_event = frame_schedule.top();
       /* printf("next event: %f\n", next_event.frame); */
       int diff_action = next_event.no_actions - no_actions;
+      if(diff_action < 0 || (diff_action == 0 && next_event.has_action())) {
+      // a late sync from before the last resync
+        frame_schedule.pop();
+        continue;
+      }
       // pursue "no action" if no action can possibly be happening within framediff
       if(max_new_frame < next_event.frame && (
         diff_action == 0
@@ -454,8 +1270,16 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
           frame_schedule.pop();
         }
         process_frames(max_new_frame);
+      } else if(next_event.frame + RESYNC_DELAY < max_new_frame) {
+      // syncs with actions got lost. the units' state already reflects them,
+      // so catch up on the count
+        process_frames(next_event.frame);
+        unpack_sync_unit(next_event);
+        no_actions = next_event.no_actions;
+        frame_schedule.pop();
       } else {
-      // there is a mismatch because some frame syncs havent arrived
+      // there is a mismatch because some frame syncs havent arrived yet
+        process_frames(max_new_frame);
         break;
       }
     }
@@ -463,31 +1287,42 @@ struct Intelligence<IntelligenceType::REMOTE> : public Intelligence<Intelligence
     frames.push(curtime);
   }
 
-  bool finalize = true;
   void start() {
     Logger::Info("iclient: started\n");
     ASSERT(should_stop());
-    finalize = false;
-    client_thread = std::thread(SoccerRemote::run, this);
+    stopping.clear();
+    socket.accept_from(pkg::MATCH_CHANNEL, {server_addr});
+    tasks.spawn(scheduler, scheduler.serve(socket, pkg::MATCH_CHANNEL,
+      [this]() { return !should_stop(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      [this]() { tick(); },
+      &stopping));
+    tasks.spawn(scheduler, probe());
   }
   void stop() {
     ASSERT(!should_stop());
-    {
-      std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-      finalize = true;
-    }
-    client_thread.join();
+    stopping.raise();
+    tasks.wait();
+    socket.accept_all(pkg::MATCH_CHANNEL);
+    socket.set_session(server_addr, pkg::MATCH_CHANNEL, net::NO_SESSION);
     Logger::Info("iclient: finished\n");
   }
   bool should_stop() {
-    std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-    return finalize;
+    return stopping.raised();
   }
 
   template <typename T>
   void send_action(const T &data) {
     printf("iclient: sending action %hhu\n", data.a);
-    socket.send(net::make_package(server_addr, data));
+    std::lock_guard<std::recursive_mutex> guard(actions_mtx);
+    auto packet = actions.push(data, Timer::system_time());
+    // the server stopped acknowledging actions, the match is over for us
+    if(!packet.has_value()) {
+      Logger::Warning("iclient: %zu actions unacknowledged, leaving\n", actions.size());
+      leave();
+      return;
+    }
+    socket.send(net::make_package(server_addr, packet.value()));
   }
 
   void z_action() {
@@ -8,14 +8,19 @@
 
 #include <map>
 #include <set>
-#include <thread>
+#include <vector>
 #include <mutex>
 
 #include "Network.hpp"
+#include "Async.hpp"
+#include "Sessions.hpp"
 #include "Soccer.hpp"
 #include "Intelligence.hpp"
 
 namespace pkg {
+  constexpr net::channel_t METASERVER_CHANNEL = 1;
+  constexpr net::channel_t LOBBY_CHANNEL = 2;
+
   enum class LobbyAction : int8_t {
     NOTHING, CONNECT, DISCONNECT, UNHOST, START, QUERY
   };
@@ -69,9 +74,47 @@ namespace pkg {
       strncpy(name, s.c_str(), std::min<int>(s.length() + 1, 30));
       name[29] = '\0';
     }
+
+    // as sent by a peer, which may have left it unterminated
+    std::string get_name() const {
+      return std::string(name, strnlen(name, sizeof(name) - 1));
+    }
   } ATTRIB_PACKED;
 }
 
+NET_MESSAGE(pkg::metaserver_hello_struct, 0x10, 1)
+NET_MESSAGE(pkg::metaserver_host_struct, 0x11, 1)
+NET_MESSAGE(pkg::lobby_hello_struct, 0x20, 1)
+NET_MESSAGE(pkg::lobby_start_struct, 0x21, 1)
+NET_MESSAGE(pkg::lobby_query_struct, 0x22, 1)
+NET_MESSAGE(pkg::lobby_query_response_struct, 0x23, 1)
+NET_SESSION_MESSAGES(pkg::METASERVER_CHANNEL)
+NET_SESSION_MESSAGES(pkg::LOBBY_CHANNEL)
+
+NET_FIELDS(pkg::metaserver_hello_struct,
+  net::Field<&S::action, net::Bits<2>>)
+NET_FIELDS(pkg::metaserver_host_struct,
+  net::Field<&S::action, net::Bits<2>>,
+  net::Field<&S::name, net::String>)
+NET_FIELDS(pkg::lobby_hello_struct,
+  net::Field<&S::action, net::Bits<3>>)
+NET_FIELDS(pkg::lobby_start_struct,
+  net::Field<&S::action, net::Bits<3>>,
+  net::Field<&S::index, net::Bits<7>>,
+  net::Field<&S::team1, net::Bits<7>>,
+  net::Field<&S::team2, net::Bits<7>>)
+NET_FIELDS(pkg::lobby_query_struct,
+  net::Field<&S::action, net::Bits<3>>,
+  net::Field<&S::addr, net::Ipv4>)
+NET_FIELDS(pkg::lobby_participant_struct,
+  net::Field<&S::ind, net::Bits<7>>,
+  net::Field<&S::itype, net::Bits<2>>,
+  net::Field<&S::team, net::Bits<1>>)
+NET_FIELDS(pkg::lobby_query_response_struct,
+  net::Field<&S::addr, net::Ipv4>,
+  net::Field<&S::active, net::Bits<1>>,
+  net::Field<&S::info, net::Nested>)
+
 class Lobby {
 public:
 private:
@@ -171,29 +214,71 @@ public:
   }
 };
 
+// the actors run as tasks on the scheduler of the socket they share. the gui
+// sets their state from its own thread
 struct LobbyActor {
   Lobby lobby;
-  LobbyActor():
-    lobby()
+  net::Scheduler &scheduler;
+  net::TaskGroup tasks;
+  // raised while the actor is not running
+  net::Signal stopping;
+  net::Signal state_changed;
+
+  LobbyActor(net::Scheduler &scheduler):
+    lobby(),
+    scheduler(scheduler),
+    stopping(true)
   {}
   bool is_active() {
     return !should_stop();
   }
   virtual void start() = 0;
   virtual void stop() = 0;
-  virtual bool should_stop() = 0;
+  bool should_stop() {
+    return stopping.raised();
+  }
   virtual Intelligence<IntelligenceType::ABSTRACT> *make_intelligence(Soccer &soccer) = 0;
   virtual ~LobbyActor()
   {}
 
+  // acts on the state as soon as it is set, once more when stopping
+  virtual void trigger_events() = 0;
+  net::Task<> follow_state() {
+    while(1) {
+      co_await scheduler.wait(state_changed);
+      state_changed.clear();
+      trigger_events();
+      if(should_stop()) {
+        break;
+      }
+    }
+  }
+
+  void start_tasks() {
+    ASSERT(should_stop());
+    stopping.clear();
+    tasks.spawn(scheduler, follow_state());
+  }
+
+  // from another thread than the scheduler's
+  void stop_tasks() {
+    ASSERT(!should_stop());
+    stopping.raise();
+    state_changed.raise();
+    tasks.wait();
+  }
+
   std::recursive_mutex state_mtx;
   enum class State {
     DEFAULT, STARTED, QUIT
   };
   State state_ = State::DEFAULT;
   void set_state(State state) {
-    std::lock_guard<std::recursive_mutex> guard(state_mtx);
-    state_ = state;
+    {
+      std::lock_guard<std::recursive_mutex> guard(state_mtx);
+      state_ = state;
+    }
+    state_changed.raise();
   }
   State state() {
     std::lock_guard<std::recursive_mutex> guard(state_mtx);
@@ -225,170 +310,153 @@ struct LobbyActor {
 // server-side
 struct LobbyServer : LobbyActor {
   net::Socket<net::SocketType::UDP> &socket;
-  std::thread server_thread;
-  std::recursive_mutex finalize_mtx;
 
   std::set<net::Addr> &metaservers;
   std::recursive_mutex &mservers_mtx;
 
-  Timer timer;
-  Timer user_timer;
-  static constexpr Timer::key_t EVENT_SEND_HELLO_MSERVERS = 1;
-  static constexpr Timer::key_t EVENT_SEND_HELLO_USERS = 2;
-  static constexpr Timer::key_t EVENT_CHECK_STATUSES = 3;
+  static constexpr Timer::time_t HELLO_PERIOD = 1.;
+  static constexpr Timer::time_t USER_TIMEOUT = 3.;
 
-  LobbyServer(net::Socket<net::SocketType::UDP> &socket, std::set<net::Addr> &metaservers, std::recursive_mutex &mservers_mtx):
-    LobbyActor(),
+  // a user is kept while it sends anything within USER_TIMEOUT
+  struct User {
+    Timer::time_t last_seen = .0;
+  };
+  net::Sessions<User> users;
+
+  LobbyServer(net::Socket<net::SocketType::UDP> &socket, net::Scheduler &scheduler, std::set<net::Addr> &metaservers, std::recursive_mutex &mservers_mtx):
+    LobbyActor(scheduler),
     socket(socket),
     metaservers(metaservers),
     mservers_mtx(mservers_mtx)
-  {
-    set_timer();
-  }
+  {}
 
   net::Addr host() {
     return net::Addr(INADDR_ANY, 0);
   }
 
-  void set_timer() {
-    timer.set_timeout(EVENT_SEND_HELLO_MSERVERS, Timer::time_t(1.));
-    timer.set_timeout(EVENT_SEND_HELLO_USERS, Timer::time_t(1.));
-    timer.set_timeout(EVENT_CHECK_STATUSES, Timer::time_t(3.));
+  // to the metaservers and the users, once per HELLO_PERIOD
+  net::Task<> send_hellos() {
+    while(!should_stop()) {
+      co_await scheduler.wait(stopping, HELLO_PERIOD);
+      if(should_stop() || has_started() || has_quit()) {
+        continue;
+      }
+      Logger::Info("%.2f lserver: sending hello to metaservers\n", Timer::system_time());
+      send_metaservers((pkg::metaserver_hello_struct){
+        .action = pkg::MSAction::HELLO
+      });
+      if(rand() % 3 || lobby.empty()) {
+        send_action((pkg::lobby_hello_struct){
+          .action = pkg::LobbyAction::NOTHING
+        });
+      } else {
+        net::Addr addr = lobby.random();
+        send_action((pkg::lobby_query_response_struct){
+          .addr = addr,
+          .active = true,
+          .info = lobby[addr]
+        });
+      }
+    }
   }
 
-  static void run(LobbyServer *server) {
-    server->timer.set_time(Timer::system_time());
-    server->socket.listen(
-      [&]() mutable {
-        server->trigger_events();
-        if(server->has_started() || server->has_quit()) {
-          return !server->should_stop();
+  // clean up inactive users
+  net::Task<> expire_users() {
+    while(!should_stop()) {
+      co_await scheduler.wait(stopping, USER_TIMEOUT);
+      if(should_stop() || has_started() || has_quit()) {
+        continue;
+      }
+      const Timer::time_t now = Timer::system_time();
+      std::string s = "";
+      std::vector<net::Addr> exusers;
+      users.each([&](net::session_t, const net::Addr &u, User &user) mutable {
+        if(user.last_seen + USER_TIMEOUT < now) {
+          Logger::Info("%.2f lserver: removing user %s\n", now, u.to_str().c_str());
+          exusers.push_back(u);
+        } else {
+          s += u.to_str() + " ";
         }
-        /* usleep(1e6 / 24); */
-        server->timer.set_time(Timer::system_time());
-        // send hello to servers
-        server->timer.periodic(EVENT_SEND_HELLO_MSERVERS, [&]() mutable {
-          Logger::Info("%.2f lserver: sending hello to metaservers\n", server->timer.current_time);
-          std::lock_guard<std::recursive_mutex> mguard(server->mservers_mtx);
-          for(auto &m : server->metaservers) {
-            server->socket.send(net::make_package(m, (pkg::metaserver_hello_struct){
-              .action = pkg::MSAction::HELLO
-            }));
-          }
-        });
-        // send hello to clients
-        server->timer.periodic(EVENT_SEND_HELLO_USERS, [&]() mutable {
-          if(rand() % 3 || server->lobby.empty()) {
-            server->send_action((pkg::lobby_hello_struct){
-              .action = pkg::LobbyAction::NOTHING
-            });
-          } else {
-            net::Addr addr = server->lobby.random();
-            server->send_action((pkg::lobby_query_response_struct){
-              .addr = addr,
-              .active = true,
-              .info = server->lobby[addr]
-            });
-          }
-        });
-        // clean up inactive users
-        server->timer.periodic(EVENT_CHECK_STATUSES, [&]() mutable {
-          server->user_timer.set_time(Timer::system_time());
-          std::string s = "";
-          std::set<net::Addr> exusers;
-          {
-            server->lobby.iterate([&](auto &p) mutable {
-              const auto &u = p.first;
-              if(u == server->host()) {
-                return true;
-              }
-              if(server->user_timer.timed_out(Timer::key_t(u.ip))) {
-                Logger::Info("%.2f lserver: removing user %s\n", server->timer.current_time, u.to_str().c_str());
-                exusers.insert(u);
-              } else {
-                s += u.to_str() + " ";
-              }
-              return true;
-            });
-          }
-          for(auto &u : exusers) {
-            if(server->lobby.find(u)) {
-              server->action_kick(u);
+      });
+      for(auto &u : exusers) {
+        if(lobby.find(u)) {
+          action_kick(u);
+        }
+      }
+      Logger::Info("%.2f lserver: users [ %s]\n", now, s.c_str());
+    }
+  }
+
+  void handle(const net::BlobView &blob) {
+    if(has_started() || has_quit()) {
+      return;
+    }
+    const net::session_t session = users.identify(blob);
+    bool found = session != net::NO_SESSION;
+    if(found) {
+      action_activity(session);
+    }
+    net::Protocol<
+      pkg::lobby_hello_struct,
+      pkg::lobby_query_struct
+    >::dispatch(blob,
+      // received hello from client
+      [&](const auto &hello) mutable {
+        Logger::Info("%.2f received signal %d from %s\n", Timer::system_time(), hello.action, blob.addr.to_str().c_str());
+        switch(hello.action) {
+          case pkg::LobbyAction::NOTHING:
+            // the session sent on connect got lost
+            if(found && blob.session() == net::NO_SESSION) {
+              send_session(blob.addr, session);
             }
-          }
-          Logger::Info("%.2f lserver: users [ %s]\n", server->timer.current_time, s.c_str());
-        });
-        return !server->should_stop();
-      },
-      [&](const net::Blob &blob) mutable {
-        if(server->has_started() || server->has_quit()) {
-          return !server->should_stop();
+          break;
+          case pkg::LobbyAction::CONNECT:
+            if(!found) {
+              action_join(blob.addr);
+            }
+          break;
+          case pkg::LobbyAction::DISCONNECT:
+            if(found) {
+              action_kick(blob.addr);
+            }
+          break;
+          case pkg::LobbyAction::QUERY:break;
+          case pkg::LobbyAction::UNHOST:break;
+          case pkg::LobbyAction::START:break;
         }
-        bool found = server->lobby.find(blob.addr);
+      },
+      [&](const auto &query) mutable {
         if(found) {
-          server->action_activity(blob.addr);
-        }
-        // received hello from client
-        static_assert(net::Typecheck::all_distinct<pkg::lobby_hello_struct, pkg::lobby_query_struct>);
-        blob.try_visit_as<pkg::lobby_hello_struct>([&](const auto hello) mutable {
-          Logger::Info("%.2f received signal %d from %s\n", server->timer.current_time, hello.action, blob.addr.to_str().c_str());
-          switch(hello.action) {
-            case pkg::LobbyAction::NOTHING:break;
-            case pkg::LobbyAction::CONNECT:
-              if(!found) {
-                server->action_join(blob.addr);
-              }
-            break;
-            case pkg::LobbyAction::DISCONNECT:
-              if(found) {
-                server->action_kick(blob.addr);
-              }
-            break;
-            case pkg::LobbyAction::QUERY:break;
-            case pkg::LobbyAction::UNHOST:break;
-            case pkg::LobbyAction::START:break;
-          }
-        });
-        blob.try_visit_as<pkg::lobby_query_struct>([&](const auto query) mutable {
-          if(found) {
-            pkg::lobby_query_response_struct data = {
-              .addr = query.addr,
-              .active = server->lobby.find(query.addr)
-            };
-            if(data.active) {
-              data.info = server->lobby[query.addr];
-            }
-            server->socket.send(net::make_package(blob.addr, data));
+          pkg::lobby_query_response_struct data = {
+            .addr = query.addr,
+            .active = lobby.find(query.addr)
+          };
+          if(data.active) {
+            data.info = lobby[query.addr];
           }
-        });
-        return !server->should_stop();
+          socket.send(net::make_package(blob.addr, data));
+        }
       }
     );
   }
 
-  bool finalize = false;
   void start() {
     Logger::Info("lserver: started\n");
     lobby.add_participant(host(), IntelligenceType::SERVER);
-    finalize = false;
-    server_thread = std::thread(LobbyServer::run, this);
-  }
+    start_tasks();
+    tasks.spawn(scheduler, scheduler.serve(socket, pkg::LOBBY_CHANNEL,
+      [this]() { return !should_stop(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      []() {},
+      &stopping));
+    tasks.spawn(scheduler, send_hellos());
+    tasks.spawn(scheduler, expire_users());
+  }
+  // a host which quit unhosts on the way
   void stop() {
-    ASSERT(!should_stop());
-    if(has_quit()) {
-      action_unhost();
-    }
-    {
-      std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-      finalize = true;
-    }
-    server_thread.join();
+    stop_tasks();
     Logger::Info("lserver: finished\n");
   }
-  bool should_stop() {
-    std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-    return finalize;
-  }
 
   bool is_server() {
     return true;
@@ -396,14 +464,25 @@ struct LobbyServer : LobbyActor {
 
   template <typename DataT>
   void send_action(DataT data) {
+    std::vector<net::Addr> users;
     lobby.iterate([&](const auto &p) mutable {
       const auto &u = p.first;
-      if(u == host()) {
-        return true;
+      if(u != host()) {
+        users.push_back(u);
       }
-      socket.send(net::make_package(u, data));
       return true;
     });
+    for(auto &u : socket.broadcast(users, data)) {
+      Logger::Warning("lserver: failed to send to %s\n", u.to_str().c_str());
+    }
+  }
+
+  template <typename DataT>
+  void send_metaservers(DataT data) {
+    std::lock_guard<std::recursive_mutex> guard(mservers_mtx);
+    for(auto &m : socket.broadcast(metaservers, data)) {
+      Logger::Warning("lserver: failed to send to %s\n", m.to_str().c_str());
+    }
   }
 
   LobbyActor::State last_state = LobbyActor::State::DEFAULT;
@@ -423,14 +502,9 @@ struct LobbyServer : LobbyActor {
       .action = pkg::LobbyAction::UNHOST
     });
     Logger::Info("%.2f lserver: sending unhost action to metaservers\n", Timer::system_time());
-    {
-      std::lock_guard<std::recursive_mutex> guard(mservers_mtx);
-      for(auto &m : metaservers) {
-        socket.send(net::make_package(m, (pkg::metaserver_host_struct){
-          .action = pkg::MSAction::UNHOST
-        }));
-      }
-    }
+    send_metaservers((pkg::metaserver_host_struct){
+      .action = pkg::MSAction::UNHOST
+    });
   }
 
   void action_gstart() {
@@ -450,13 +524,24 @@ struct LobbyServer : LobbyActor {
     });
   }
 
-  void action_activity(net::Addr addr) {
-    user_timer.set_time(Timer::system_time());
-    user_timer.set_event(Timer::key_t(addr.ip));
+  void action_activity(net::session_t session) {
+    users.get(session)->last_seen = Timer::system_time();
+  }
+
+  void send_session(net::Addr addr, net::session_t session) {
+    socket.send(net::make_package(addr, (net::session_struct<pkg::LOBBY_CHANNEL>){
+      .session = session
+    }));
   }
 
   void action_join(net::Addr addr) {
     Timer::time_t server_time = Timer::system_time();
+    const net::session_t session = users.open(addr);
+    if(session == net::NO_SESSION) {
+      Logger::Warning("%.2f lserver: no session left for %s\n", server_time, addr.to_str().c_str());
+      return;
+    }
+    send_session(addr, session);
     Logger::Info("%.2f lserver: sending action join for %s to clients\n", server_time, addr.to_str().c_str());
     lobby.add_participant(addr);
     send_action((pkg::lobby_query_response_struct){
@@ -464,9 +549,7 @@ struct LobbyServer : LobbyActor {
       .active = true,
       .info = lobby[addr]
     });
-    user_timer.set_time(Timer::system_time());
-    user_timer.set_event(Timer::key_t(addr.ip));
-    user_timer.set_timeout(Timer::key_t(addr.ip), Timer::time_t(3.));
+    action_activity(session);
   }
 
   void action_kick(net::Addr addr) {
@@ -477,7 +560,10 @@ struct LobbyServer : LobbyActor {
       .addr = addr,
       .active = false,
     });
-    user_timer.erase(Timer::key_t(addr.ip));
+    const net::session_t session = users.find(addr);
+    if(session != net::NO_SESSION) {
+      users.close(session);
+    }
   }
 
   Intelligence<IntelligenceType::ABSTRACT> *make_intelligence(Soccer &soccer) {
@@ -489,15 +575,13 @@ struct LobbyServer : LobbyActor {
       }
       return true;
     });
-    return new SoccerServer(lobby[host()].ind, soccer, socket, clients);
+    return new SoccerServer(lobby[host()].ind, soccer, socket, scheduler, clients);
   }
 };
 
 struct LobbyClient : LobbyActor {
   net::Addr host;
   net::Socket<net::SocketType::UDP> &socket;
-  std::thread client_thread;
-  std::recursive_mutex finalize_mtx;
 
   struct GameMaker {
     int ind;
@@ -506,134 +590,122 @@ struct LobbyClient : LobbyActor {
   } gameMaker;
   std::recursive_mutex gmaker_mtx;
 
+  static constexpr Timer::time_t HELLO_PERIOD = 1.;
+  static constexpr Timer::time_t HOST_TIMEOUT = 3.;
+  Timer::time_t last_heard = .0;
+
   // connect at construction
-  LobbyClient(net::Socket<net::SocketType::UDP> &socket, net::Addr host):
-    LobbyActor(),
+  LobbyClient(net::Socket<net::SocketType::UDP> &socket, net::Scheduler &scheduler, net::Addr host):
+    LobbyActor(scheduler),
     host(host),
     socket(socket)
-  {
-    set_timer();
-  }
+  {}
 
   template <typename DataT>
   void send_action(const DataT hello) {
     socket.send(net::make_package(host, hello));
   }
 
-  Timer timer;
-  static constexpr Timer::key_t EVENT_SEND_HELLO = 1;
-  static constexpr Timer::key_t EVENT_HOST_ACTIVITY = 2;
-  void set_timer() {
-    timer.set_timeout(EVENT_SEND_HELLO, Timer::time_t(1.));
-    timer.set_timeout(EVENT_HOST_ACTIVITY, Timer::time_t(3.));
-  }
-
-  void register_host_activity() {
-    timer.set_time(Timer::system_time());
-    timer.set_event(EVENT_HOST_ACTIVITY);
+  // once per HELLO_PERIOD, the host is left if it went quiet for HOST_TIMEOUT
+  net::Task<> send_hellos() {
+    while(!should_stop()) {
+      co_await scheduler.wait(stopping, HELLO_PERIOD);
+      if(should_stop() || has_started() || has_quit()) {
+        continue;
+      }
+      const Timer::time_t now = Timer::system_time();
+      if(rand() % 3 || lobby.empty()) {
+        Logger::Info("%.2f lclient: sending hello\n", now);
+        send_action((pkg::lobby_hello_struct){
+          .action = pkg::LobbyAction::NOTHING
+        });
+      } else {
+        Logger::Info("%.2f lclient: sending query\n", now);
+        send_action((pkg::lobby_query_struct){
+          .action = pkg::LobbyAction::QUERY,
+          .addr = lobby.random()
+        });
+      }
+      if(last_heard + HOST_TIMEOUT < now) {
+        Logger::Info("%.2f lclient: host timed out (%.2fs)\n", now, now - last_heard);
+        action_leave();
+      }
+    }
   }
 
-  static void run(LobbyClient *client) {
-    client->timer.set_time(Timer::system_time());
-    client->timer.set_event(EVENT_HOST_ACTIVITY);
-    client->socket.listen(
-      [&]() mutable {
-        client->trigger_events();
-        if(client->has_started() || client->has_quit()) {
-          return !client->should_stop();
+  void handle(const net::BlobView &blob) {
+    if(has_started() || has_quit() || blob.addr != host) {
+      return;
+    }
+    const Timer::time_t now = Timer::system_time();
+    last_heard = now;
+    net::Protocol<
+      pkg::lobby_hello_struct,
+      pkg::lobby_query_response_struct,
+      pkg::lobby_start_struct,
+      net::session_struct<pkg::LOBBY_CHANNEL>
+    >::dispatch(blob,
+      // received idle ping from host
+      [&](const auto &hello) mutable {
+        if(hello.action == pkg::LobbyAction::UNHOST) {
+          Logger::Info("%.2f lclient: received UNHOST\n", now);
+          action_leave();
+          return;
+        } else {
+          Logger::Info("%.2f lclient: received ping\n", now);
         }
-        client->timer.set_time(Timer::system_time());
-        client->timer.periodic(EVENT_SEND_HELLO, [&]() mutable {
-          if(rand() % 3 || client->lobby.empty()) {
-            Logger::Info("%.2f lclient: sending hello\n", client->timer.current_time);
-            client->send_action((pkg::lobby_hello_struct){
-              .action = pkg::LobbyAction::NOTHING
-            });
-          } else {
-            Logger::Info("%.2f lclient: sending query\n", client->timer.current_time);
-            client->send_action((pkg::lobby_query_struct){
-              .action = pkg::LobbyAction::QUERY,
-              .addr = client->lobby.random()
-            });
-          }
-        });
-        if(client->timer.timed_out(EVENT_HOST_ACTIVITY) && !client->has_quit()) {
-          Logger::Info("%.2f lclient: host timed out (%.2fs)\n", client->timer.current_time, client->timer.elapsed(EVENT_HOST_ACTIVITY));
-          client->action_leave();
+      },
+      // received lobby query response
+      [&](const auto &qresp) mutable {
+        Logger::Info("%.2f lclient: received query response for (%hhd, %d, %s):\n", now, qresp.info.ind, qresp.info.team?1:0, qresp.addr.to_str().c_str());
+        if(qresp.active) {
+          lobby[qresp.addr] = qresp.info;
+        } else if(lobby.find(qresp.addr)) {
+          lobby.remove_participant(qresp.addr);
         }
-        return !client->should_stop();
       },
-      [&](const net::Blob &blob) mutable {
-        if(client->has_started() || client->has_quit() || blob.addr != client->host) {
-          return !client->should_stop();
+      // received lobby start
+      [&](const auto &start) mutable {
+        Logger::Info("%.2f lclient: received start package from server\n", now);
+        {
+          std::lock_guard<std::recursive_mutex> guard(gmaker_mtx);
+          gameMaker.ind = start.index;
+          gameMaker.team1 = start.team1;
+          gameMaker.team2 = start.team2;
         }
-        static_assert(net::Typecheck::all_distinct<
-          pkg::lobby_hello_struct,
-          pkg::lobby_query_response_struct,
-          pkg::lobby_start_struct
-        >);
-        client->register_host_activity();
-        // received idle ping from host
-        blob.try_visit_as<pkg::lobby_hello_struct>([&](const auto hello) mutable {
-          if(hello.action == pkg::LobbyAction::UNHOST) {
-            Logger::Info("%.2f lclient: received UNHOST\n", client->timer.current_time);
-            client->action_leave();
-            return;
-          } else {
-            Logger::Info("%.2f lclient: received ping\n", client->timer.current_time);
-          }
-        });
-        // received lobby query response
-        blob.try_visit_as<pkg::lobby_query_response_struct>([&](const auto qresp) mutable {
-          Logger::Info("%.2f lclient: received query response for (%hhd, %d, %s):\n", client->timer.current_time, qresp.info.ind, qresp.info.team?1:0, qresp.addr.to_str().c_str());
-          if(qresp.active) {
-            client->lobby[qresp.addr] = qresp.info;
-          } else if(client->lobby.find(qresp.addr)) {
-            client->lobby.remove_participant(qresp.addr);
-          }
-        });
-        // received lobby start
-        blob.try_visit_as<pkg::lobby_start_struct>([&](const auto start) mutable {
-          Logger::Info("%.2f lclient: received start package from server\n", client->timer.current_time);
-          {
-            std::lock_guard<std::recursive_mutex> guard(client->gmaker_mtx);
-            client->gameMaker.ind = start.index;
-            client->gameMaker.team1 = start.team1;
-            client->gameMaker.team2 = start.team2;
-          }
-          client->action_start();
-        });
-        return !client->should_stop();
+        action_start();
+      },
+      [&](const auto &response) mutable {
+        socket.set_session(host, pkg::LOBBY_CHANNEL, response.session);
       }
     );
   }
 
-  bool finalize = true;
   void start() {
-    ASSERT(should_stop());
     Logger::Info("lclient: started\n");
-    finalize = false;
+    last_heard = Timer::system_time();
+    socket.accept_from(pkg::LOBBY_CHANNEL, {host});
     socket.send(net::make_package(host, (pkg::lobby_hello_struct) {
       .action = pkg::LobbyAction::CONNECT
     }));
-    client_thread = std::thread(LobbyClient::run, this);
-  }
+    start_tasks();
+    tasks.spawn(scheduler, scheduler.serve(socket, pkg::LOBBY_CHANNEL,
+      [this]() { return !should_stop(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      []() {},
+      &stopping));
+    tasks.spawn(scheduler, send_hellos());
+  }
+  // a client which neither quit nor started disconnects on the way
   void stop() {
-    ASSERT(!should_stop());
     if(state() == LobbyActor::State::DEFAULT) {
-      action_quit();
-    }
-    {
-      std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-      finalize = true;
+      action_leave();
     }
-    client_thread.join();
+    stop_tasks();
+    socket.accept_all(pkg::LOBBY_CHANNEL);
+    socket.set_session(host, pkg::LOBBY_CHANNEL, net::NO_SESSION);
     Logger::Info("lclient: finished\n");
   }
-  bool should_stop() {
-    std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-    return finalize;
-  }
 
   bool is_client() {
     return true;
@@ -666,6 +738,6 @@ struct LobbyClient : LobbyActor {
 
   Intelligence<IntelligenceType::ABSTRACT> *make_intelligence(Soccer &soccer) {
     std::lock_guard<std::recursive_mutex> guard(gmaker_mtx);
-    return new SoccerRemote(gameMaker.ind, soccer, socket, host);
+    return new SoccerRemote(gameMaker.ind, soccer, socket, scheduler, host);
   }
 };
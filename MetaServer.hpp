@@ -5,6 +5,11 @@
 #include "Optimizations.hpp"
 #include "Timer.hpp"
 #include "Network.hpp"
+#include "ShmTransport.hpp"
+#include "Async.hpp"
+#include "Sessions.hpp"
+#include "AddrMap.hpp"
+#include "TimingWheel.hpp"
 #include "Lobby.hpp"
 
 #include <cstdint>
@@ -16,6 +21,7 @@
 #include <unordered_set>
 #include <vector>
 #include <string>
+#include <variant>
 
 namespace pkg {
   struct metaserver_query_struct {
@@ -37,9 +43,29 @@ namespace pkg {
       strncpy(name, s.c_str(), std::min<int>(s.length() + 1, 30));
       name[29] = '\0';
     }
+
+    // not relied on being terminated, it comes from the wire
+    std::string get_name() const {
+      return std::string(name, strnlen(name, sizeof(name) - 1));
+    }
   } ATTRIB_PACKED;
 }
 
+NET_MESSAGE(pkg::metaserver_query_struct, 0x12, 1)
+NET_MESSAGE(pkg::metaserver_query_response_struct, 0x13, 1)
+NET_MESSAGE(pkg::metaserver_host_response_struct, 0x14, 1)
+
+NET_FIELDS(pkg::metaserver_query_struct,
+  net::Field<&S::action, net::Bits<2>>,
+  net::Field<&S::addr, net::Ipv4>)
+NET_FIELDS(pkg::metaserver_query_response_struct,
+  net::Field<&S::addr, net::Ipv4>,
+  net::Field<&S::active, net::Bits<1>>)
+NET_FIELDS(pkg::metaserver_host_response_struct,
+  net::Field<&S::action, net::Bits<2>>,
+  net::Field<&S::host, net::Ipv4>,
+  net::Field<&S::name, net::String>)
+
 struct GameList {
   std::map<net::Addr, std::string> games;
 
@@ -60,145 +86,224 @@ struct MetaServer {
   GameList gamelist;
   net::Socket<net::SocketType::UDP> socket;
 
-  Timer timer;
-
-  std::set<net::Addr> users;
-  Timer user_timer;
-
-  MetaServer(net::port_t port=5678):
+  net::Scheduler scheduler;
+  static constexpr Timer::time_t USER_TIMEOUT = 3.;
+  static constexpr Timer::time_t USER_TICK = .1;
+  static constexpr Timer::time_t SESSION_RESEND_PERIOD = 1.;
+
+  // users are known by address. a session is handed out while there are
+  // slots, and sent again to users who do not send it back, at most once per
+  // SESSION_RESEND_PERIOD
+  struct User {
+    net::session_t session = net::NO_SESSION;
+    Timer::time_t last_seen = .0;
+    Timer::time_t session_sent = -SESSION_RESEND_PERIOD;
+  };
+  net::AddrMap<User> users;
+  net::Sessions<std::monostate> sessions;
+  // every user's lease comes up USER_TIMEOUT after it was last renewed, or
+  // later. a package only renews the lease in the user
+  TimingWheel<net::Addr> leases;
+  std::atomic<bool> finalize = false;
+
+  // socket metrics are written here every metrics_period seconds
+  FILE *metrics_file = nullptr;
+  Timer::time_t metrics_period = 10.;
+
+  MetaServer(net::port_t port=5678, net::Transport &transport=net::kernel_transport()):
     gamelist(),
-    socket(port)
+    socket(port, net::Socket<net::SocketType::UDP>::Mode::DIRECT, transport),
+    leases(USER_TICK)
   {}
 
+  // the server as tasks, which may share the scheduler with other actors
+  void spawn(net::Scheduler &scheduler) {
+    scheduler.spawn(scheduler.serve(socket, pkg::METASERVER_CHANNEL,
+      [this]() { return running(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      [this]() { socket.flush(); }));
+    scheduler.spawn(expire_users(scheduler));
+    if(metrics_file != nullptr) {
+      scheduler.spawn(dump_metrics(scheduler));
+    }
+  }
+
   void run() {
-    constexpr Timer::key_t EVENT_CHECK_STATUSES = 1;
-    timer.set_timeout(EVENT_CHECK_STATUSES, Timer::time_t(3.));
     Logger::Info("mserver: started at port %hu\n", socket.port());
-    socket.listen(
-      [&]() mutable {
-        timer.set_time(Timer::system_time());
-        // clean up inactive users
-        timer.periodic(EVENT_CHECK_STATUSES, [&]() mutable {
-          Logger::Info("mserver: cleaning up inactive users\n");
-          user_timer.set_time(Timer::system_time());
-          std::string s = "";
-          // workaround because it fails when the iterated set changes
-          std::set<net::Addr> exusers;
-          for(auto &u : users) {
-            if(user_timer.timed_out(Timer::key_t(u.ip))) {
-              Logger::Info("mserver: removing user %s\n", u.to_str().c_str());
-              exusers.insert(u);
-            } else {
-              s += u.to_str() + " ";
-            }
-          }
-          for(auto &u : exusers) {
-            if(gamelist.find(u)) {
-              unregister_host(u);
-            }
-            users.erase(u);
-            user_timer.erase(Timer::key_t(u.ip));
-          }
-          Logger::Info("mserver: users [ %s]\n", s.c_str());
-        });
-        return !feof(stdin);
-      },
-      [&](const net::Blob &blob) mutable {
-        Logger::Info("mserver: received package from %s\n", blob.addr.to_str().c_str());
-        // find out if the user already exists
-        bool found = users.find(blob.addr) != std::end(users);
-        user_timer.set_time(Timer::system_time());
-        if(found) {
-          user_timer.set_event(Timer::key_t(blob.addr.ip));
+    spawn(scheduler);
+    scheduler.run();
+    if(metrics_file != nullptr) {
+      socket.write_metrics(metrics_file);
+    }
+    Logger::Info("mserver: finisned\n");
+  }
+
+  // makes run() return, callable from any thread
+  void stop() {
+    finalize = true;
+    socket.wakeup();
+    scheduler.stop();
+  }
+
+  bool running() const {
+    return !feof(stdin) && !finalize;
+  }
+
+  // clean up inactive users whose leases come up, a tick at a time
+  net::Task<> expire_users(net::Scheduler &scheduler) {
+    while(running()) {
+      co_await scheduler.sleep(leases.tick());
+      const Timer::time_t now = Timer::system_time();
+      leases.advance(now, [&](const net::Addr &u) mutable {
+        User *user = users.find(u);
+        if(user == nullptr) {
+          return;
         }
-        static_assert(net::Typecheck::all_distinct<
-          pkg::metaserver_hello_struct,
-          pkg::metaserver_query_struct,
-          pkg::metaserver_host_struct
-        >);
-        // received hello package
-        blob.try_visit_as<pkg::metaserver_hello_struct>([&](const auto hello) mutable {
-          Logger::Info("mserver: recognized as hello package, found=%d\n", found);
-          if(!found) {
-            // add user
-            Logger::Info("mserver: added user %s\n", blob.addr.to_str().c_str());
-            user_timer.set_event(Timer::key_t(blob.addr.ip));
-            user_timer.set_timeout(Timer::key_t(blob.addr.ip), Timer::time_t(3.));
-            users.insert(blob.addr);
-          } else if(hello.action == pkg::MSAction::QUERY) {
-            // send random game information
-            if(!gamelist.games.empty()) {
-              int i = 0; int j = rand() % gamelist.games.size();
-              for(auto &it : gamelist.games) {
-                if(i == j) {
-                  pkg::metaserver_host_response_struct gameinfo = {
-                    .action = pkg::MSAction::HOST,
-                    .host = it.first,
-                  };
-                  gameinfo.set_name(it.second);
-                  socket.send(net::make_package(blob.addr, gameinfo));
-                  Logger::Info("mserver: randomly sending host info on %s\n", blob.addr.to_str().c_str());
-                  break;
-                }
-                ++i;
-              }
-            }
-          }
-        });
-        // respond whether the address is active or not
-        blob.try_visit_as<pkg::metaserver_query_struct>([&](const auto query) mutable {
-          Logger::Info("mserver: recognized as query package\n");
-          if(!found) {
-            return;
+        if(user->last_seen + USER_TIMEOUT > now) {
+          leases.schedule(user->last_seen + USER_TIMEOUT, u);
+          return;
+        }
+        Logger::Info("mserver: removing user %s\n", u.to_str().c_str());
+        if(gamelist.find(u)) {
+          unregister_host(u);
+        }
+        sessions.close(user->session);
+        users.erase(u);
+      });
+      socket.flush();
+    }
+  }
+
+  net::Task<> dump_metrics(net::Scheduler &scheduler) {
+    while(running()) {
+      co_await scheduler.sleep(metrics_period);
+      socket.write_metrics(metrics_file);
+    }
+  }
+
+  void handle(const net::BlobView &blob) {
+    Logger::Info("mserver: received package from %s\n", blob.addr.to_str().c_str());
+    // find out if the user already exists
+    const Timer::time_t now = Timer::system_time();
+    User *user = users.find(blob.addr);
+    bool found = user != nullptr;
+    if(found) {
+      user->last_seen = now;
+    }
+    net::Protocol<
+      pkg::metaserver_hello_struct,
+      pkg::metaserver_query_struct,
+      pkg::metaserver_host_struct
+    >::dispatch(blob,
+      // received hello package
+      [&](const auto &hello) mutable {
+        Logger::Info("mserver: recognized as hello package, found=%d\n", found);
+        if(!found) {
+          // add user
+          user = users.insert(blob.addr).first;
+          user->last_seen = now;
+          user->session = sessions.open(blob.addr);
+          if(user->session == net::NO_SESSION) {
+            Logger::Warning("mserver: no session left for %s\n", blob.addr.to_str().c_str());
           }
-          ASSERT(query.action == pkg::MSAction::QUERY);
-          socket.send(net::make_package(blob.addr, (pkg::metaserver_query_response_struct){
-            .addr = query.addr,
-            .active = gamelist.find(query.addr)
-          }));
-        });
-        // received hosting action
-        blob.try_visit_as<pkg::metaserver_host_struct>([&](auto host) mutable {
-          Logger::Info("mserver: recognized as hosting struct\n");
-          switch(host.action) {
-            case pkg::MSAction::HELLO:break;
-            case pkg::MSAction::QUERY:break;
-            case pkg::MSAction::HOST:
-              if(found) {
-                host.name[29] = '\0';
-                Logger::Info("mserver: hosting game name='%s'\n", host.name);
-                register_host(blob.addr, host.name);
-                pkg::metaserver_host_response_struct response = {
+          leases.schedule(now + USER_TIMEOUT, blob.addr);
+          Logger::Info("mserver: added user %s\n", blob.addr.to_str().c_str());
+          send_session(blob.addr, *user);
+          return;
+        }
+        // the session sent on the first hello got lost
+        if(blob.session() == net::NO_SESSION) {
+          send_session(blob.addr, *user);
+        }
+        if(hello.action == pkg::MSAction::QUERY) {
+          // send random game information
+          if(!gamelist.games.empty()) {
+            int i = 0; int j = rand() % gamelist.games.size();
+            for(auto &it : gamelist.games) {
+              if(i == j) {
+                pkg::metaserver_host_response_struct gameinfo = {
                   .action = pkg::MSAction::HOST,
-                  .host = blob.addr
+                  .host = it.first,
                 };
-                std::string name = host.name;
-                response.set_name(name);
-                Logger::Info("mserver: sending action host host=%s name=%s\n", blob.addr.to_str().c_str(), name.c_str());
-                for(auto &u : users) {
-                  socket.send(net::make_package(u, response));
-                }
-              }
-            break;
-            case pkg::MSAction::UNHOST:
-              if(found) {
-                host.name[29] = '\0';
-                Logger::Info("mserver: unhosting game\n");
-                unregister_host(blob.addr);
-                Logger::Info("mserver: sending action unhost host=%s\n", blob.addr.to_str().c_str());
-                for(auto &u : users) {
-                  socket.send(net::make_package(u, (pkg::metaserver_host_response_struct){
-                    .action = pkg::MSAction::UNHOST,
-                    .host = blob.addr
-                  }));
-                }
+                gameinfo.set_name(it.second);
+                socket.send(net::make_package(blob.addr, gameinfo));
+                Logger::Info("mserver: randomly sending host info on %s\n", blob.addr.to_str().c_str());
+                break;
               }
-            break;
+              ++i;
+            }
           }
-        });
-        return !feof(stdin);
+        }
+      },
+      // respond whether the address is active or not
+      [&](const auto &query) mutable {
+        Logger::Info("mserver: recognized as query package\n");
+        if(!found) {
+          return;
+        }
+        ASSERT(query.action == pkg::MSAction::QUERY);
+        socket.send(net::make_package(blob.addr, (pkg::metaserver_query_response_struct){
+          .addr = query.addr,
+          .active = gamelist.find(query.addr)
+        }));
+      },
+      // received hosting action
+      [&](const auto &host) mutable {
+        Logger::Info("mserver: recognized as hosting struct\n");
+        switch(host.action) {
+          case pkg::MSAction::HELLO:break;
+          case pkg::MSAction::QUERY:break;
+          case pkg::MSAction::HOST:
+            if(found) {
+              std::string name = host.get_name();
+              Logger::Info("mserver: hosting game name='%s'\n", name.c_str());
+              register_host(blob.addr, name);
+              pkg::metaserver_host_response_struct response = {
+                .action = pkg::MSAction::HOST,
+                .host = blob.addr
+              };
+              response.set_name(name);
+              Logger::Info("mserver: sending action host host=%s name=%s\n", blob.addr.to_str().c_str(), name.c_str());
+              broadcast(response);
+            }
+          break;
+          case pkg::MSAction::UNHOST:
+            if(found) {
+              Logger::Info("mserver: unhosting game\n");
+              unregister_host(blob.addr);
+              Logger::Info("mserver: sending action unhost host=%s\n", blob.addr.to_str().c_str());
+              broadcast((pkg::metaserver_host_response_struct){
+                .action = pkg::MSAction::UNHOST,
+                .host = blob.addr
+              });
+            }
+          break;
+        }
+      }
+    );
+  }
+
+  void send_session(net::Addr addr, User &user) {
+    const Timer::time_t now = Timer::system_time();
+    if(user.session == net::NO_SESSION || now - user.session_sent < SESSION_RESEND_PERIOD) {
+      return;
+    }
+    user.session_sent = now;
+    socket.send(net::make_package(addr, (net::session_struct<pkg::METASERVER_CHANNEL>){
+      .session = user.session
+    }));
+  }
+
+  template <typename DataT>
+  void broadcast(const DataT data) {
+    std::vector<net::Addr> addrs;
+    addrs.reserve(users.size());
+    users.each([&](const net::Addr &addr, User &) mutable {
+      addrs.push_back(addr);
     });
-    Logger::Info("mserver: finisned\n");
+    for(auto &u : socket.broadcast(addrs, data)) {
+      Logger::Warning("mserver: failed to send to %s\n", u.to_str().c_str());
+    }
   }
 
   // parent lock
@@ -228,118 +333,137 @@ struct MetaServerClient {
     net::Addr host;
   } lobbyMaker;
 
-  std::thread user_thread;
   std::recursive_mutex mservers_mtx;
   std::recursive_mutex lmaker_mtx;
-  std::recursive_mutex finalize_mtx;
+  // the lobby and the match run their tasks here as well, and it is gone
+  // before the socket is
+  net::SchedulerThread scheduler_thread;
+  net::TaskGroup tasks;
+  // raised while the client is not running
+  net::Signal stopping;
+
+  static constexpr Timer::time_t HELLO_PERIOD = 1.;
+  static constexpr Timer::time_t QUERY_PERIOD = 2.;
+
+  // the match with a player on the same machine goes through shared memory
+  MetaServerClient(std::set<net::Addr> metaservers, net::port_t port=5679, net::Transport &transport=net::shm_transport()):
+    socket(port, net::Socket<net::SocketType::UDP>::Mode::IO_THREAD, transport),
+    metaservers(metaservers),
+    stopping(true)
+  {}
 
-  MetaServerClient(std::set<net::Addr> metaservers, net::port_t port=5679):
-    socket(port),
-    metaservers(metaservers)
-  {
-    set_timer();
+  net::Scheduler &scheduler() {
+    return scheduler_thread.scheduler();
   }
 
-  Timer timer;
-  static constexpr Timer::key_t EVENT_SEND_HELLO = 1;
-  static constexpr Timer::key_t EVENT_SEND_QUERY = 2;
-  void set_timer() {
-    timer.set_timeout(EVENT_SEND_HELLO, Timer::time_t(1.));
-    timer.set_timeout(EVENT_SEND_QUERY, Timer::time_t(2.));
+  bool is_idle() {
+    return has_quit() || has_hosted();
   }
 
-  static void run(MetaServerClient *client) {
-    client->socket.listen(
-      [&]() mutable {
-        if(client->has_quit() || client->has_hosted()) {
-          return !client->should_stop();
+  // send hello to the metaserver every second
+  net::Task<> send_hellos() {
+    while(!should_stop()) {
+      co_await scheduler().wait(stopping, HELLO_PERIOD);
+      if(should_stop() || is_idle()) {
+        continue;
+      }
+      if(rand() % 3) {
+        Logger::Info("mclient: sending hello\n");
+        send_action((pkg::metaserver_hello_struct){
+          .action = pkg::MSAction::HELLO
+        });
+      } else {
+        Logger::Info("mclient: sending query\n");
+        send_action((pkg::metaserver_hello_struct){
+          .action = pkg::MSAction::QUERY
+        });
+      }
+    }
+  }
+
+  // send query for random host
+  net::Task<> send_queries() {
+    while(!should_stop()) {
+      co_await scheduler().wait(stopping, QUERY_PERIOD);
+      if(should_stop() || is_idle()) {
+        continue;
+      }
+      send_query();
+    }
+  }
+
+  void send_query() {
+    std::lock_guard<std::recursive_mutex> guard(mservers_mtx);
+    if(gamelists.empty()) {
+      return;
+    }
+    int i = 0, j = rand() % gamelists.size();
+    for(auto &e:gamelists) {
+      if(i == j) {
+        auto &games = e.second.games;
+        if(games.empty()) {
+          return;
         }
-        /* usleep(1e6 / 24.); */
-        client->timer.set_time(Timer::system_time());
-        // send hello to the metaserver every second
-        client->timer.periodic(EVENT_SEND_HELLO, [&]() mutable {
-          if(rand() % 3) {
-            Logger::Info("mclient: sending hello\n");
-            client->send_action((pkg::metaserver_hello_struct){
-              .action = pkg::MSAction::HELLO
-            });
-          } else {
-            Logger::Info("mclient: sending query\n");
-            client->send_action((pkg::metaserver_hello_struct){
-              .action = pkg::MSAction::QUERY
+        int k = 0, m = rand() % games.size();
+        for(auto &e2:games) {
+          if(k == m) {
+            auto &addr = e2.first;
+            Logger::Info("mclient: sending query for host %s\n", addr.to_str().c_str());
+            send_action((pkg::metaserver_query_struct){
+              .action = pkg::MSAction::QUERY,
+              .addr = addr
             });
-          }
-        });
-        // send query for random host
-        client->timer.periodic(EVENT_SEND_QUERY, [&]() mutable {
-          std::lock_guard<std::recursive_mutex> guard(client->mservers_mtx);
-          if(client->gamelists.empty()) {
             return;
           }
-          int i = 0, j = rand() % client->gamelists.size();
-          for(auto &e:client->gamelists) {
-            if(i == j) {
-              auto &games = e.second.games;
-              if(games.empty()) {
-                return;
-              }
-              int k = 0, m = rand() % games.size();
-              for(auto &e2:games) {
-                if(k == m) {
-                  auto &addr = e2.first;
-                  Logger::Info("mclient: sending query for host %s\n", addr.to_str().c_str());
-                  client->send_action((pkg::metaserver_query_struct){
-                    .action = pkg::MSAction::QUERY,
-                    .addr = addr
-                  });
-                  return;
-                }
-                ++k;
-              }
-            }
-            ++i;
-          }
-        });
-        return !client->should_stop();
+          ++k;
+        }
+      }
+      ++i;
+    }
+  }
+
+  void handle(const net::BlobView &blob) {
+    if(is_idle()) {
+      return;
+    }
+    {
+      std::lock_guard<std::recursive_mutex> guard(mservers_mtx);
+      if(metaservers.find(blob.addr) == std::end(metaservers)) {
+        return;
+      }
+    }
+    net::Protocol<
+      net::session_struct<pkg::METASERVER_CHANNEL>,
+      pkg::metaserver_query_response_struct,
+      pkg::metaserver_host_response_struct
+    >::dispatch(blob,
+      // stamped into everything sent to the metaserver from now on, the
+      // lobby server's hellos included
+      [&](const auto &response) mutable {
+        socket.set_session(blob.addr, pkg::METASERVER_CHANNEL, response.session);
       },
-      [&](const net::Blob &blob) {
-        if(client->has_quit() || client->has_hosted()) {
-          return !client->should_stop();
+      // recognize as a query response struct
+      [&](const auto &response) mutable {
+        // unregister if no longer marked active
+        Logger::Info("mclient: received query response for %s\n", response.addr.to_str().c_str());
+        if(gamelists[blob.addr].find(response.addr) && !response.active) {
+          unregister_host(blob.addr, response.addr);
         }
-        {
-          std::lock_guard<std::recursive_mutex> guard(client->mservers_mtx);
-          if(client->metaservers.find(blob.addr) == std::end(client->metaservers)) {
-            return !client->should_stop();
-          }
+      },
+      // recognize as a hosting respond struct
+      [&](const auto &response) mutable {
+        switch(response.action) {
+          case pkg::MSAction::HELLO:break;
+          case pkg::MSAction::QUERY:break;
+          case pkg::MSAction::HOST:
+            Logger::Info("mclient: register game host=%s name=%s\n", blob.addr.to_str().c_str(), response.get_name().c_str());
+            register_host(blob.addr, response.host, response.get_name());
+          break;
+          case pkg::MSAction::UNHOST:
+            Logger::Info("mclient: unregister game host=%s\n", blob.addr.to_str().c_str());
+            unregister_host(blob.addr, response.host);
+          break;
         }
-        static_assert(net::Typecheck::all_distinct<
-          pkg::metaserver_query_response_struct,
-          pkg::metaserver_host_response_struct
-        >);
-        // recognize as a query response struct
-        blob.try_visit_as<pkg::metaserver_query_response_struct>([&](const auto response) mutable {
-          // unregister if no longer marked active
-          Logger::Info("mclient: received query response for %s\n", response.addr.to_str().c_str());
-          if(client->gamelists[blob.addr].find(response.addr) && !response.active) {
-            client->unregister_host(blob.addr, response.addr);
-          }
-        });
-        // recognize as a hosting respond struct
-        blob.try_visit_as<pkg::metaserver_host_response_struct>([&](const auto response) mutable {
-          switch(response.action) {
-            case pkg::MSAction::HELLO:break;
-            case pkg::MSAction::QUERY:break;
-            case pkg::MSAction::HOST:
-              Logger::Info("mclient: register game host=%s name=%s\n", blob.addr.to_str().c_str(), response.name);
-              client->register_host(blob.addr, response.host, response.name);
-            break;
-            case pkg::MSAction::UNHOST:
-              Logger::Info("mclient: unregister game host=%s\n", blob.addr.to_str().c_str());
-              client->unregister_host(blob.addr, response.host);
-            break;
-          }
-        });
-        return !client->should_stop();
       }
     );
   }
@@ -411,17 +535,17 @@ struct MetaServerClient {
   template <typename DataT>
   void send_action(DataT data) {
     std::lock_guard<std::recursive_mutex> mguard(mservers_mtx);
-    for(auto &m : metaservers) {
-      socket.send(net::make_package(m, data));
+    for(auto &m : socket.broadcast(metaservers, data)) {
+      Logger::Warning("mclient: failed to send to %s\n", m.to_str().c_str());
     }
   }
 
   LobbyActor *make_lobby() {
     std::lock_guard<std::recursive_mutex> lmguard(lmaker_mtx);
     if(lobbyMaker.ltype == LobbyMaker::type::SERVER) {
-      return new LobbyServer(socket, metaservers, mservers_mtx);
+      return new LobbyServer(socket, scheduler(), metaservers, mservers_mtx);
     } else if(lobbyMaker.ltype == LobbyMaker::type::CLIENT) {
-      return new LobbyClient(socket, lobbyMaker.host);
+      return new LobbyClient(socket, scheduler(), lobbyMaker.host);
     }
     return nullptr;
   }
@@ -436,23 +560,24 @@ struct MetaServerClient {
     s += "]";
     Logger::Info("mclient: started, mserver=%s\n", s.c_str());
     ASSERT(should_stop());
-    finalize = false;
-    user_thread = std::thread(MetaServerClient::run, this);
+    stopping.clear();
+    tasks.spawn(scheduler(), scheduler().serve(socket, pkg::METASERVER_CHANNEL,
+      [this]() { return !should_stop(); },
+      [this](const net::BlobView &blob) { handle(blob); },
+      []() {},
+      &stopping));
+    tasks.spawn(scheduler(), send_hellos());
+    tasks.spawn(scheduler(), send_queries());
   }
 
-  bool finalize = true;
   bool should_stop() {
-    std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-    return finalize;
+    return stopping.raised();
   }
 
   void stop() {
     ASSERT(!should_stop());
-    {
-      std::lock_guard<std::recursive_mutex> guard(finalize_mtx);
-      finalize = true;
-    }
-    user_thread.join();
+    stopping.raise();
+    tasks.wait();
     Logger::Info("mclient: finished\n");
   }
 
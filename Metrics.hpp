@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+
+#include <map>
+#include <array>
+#include <optional>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace net {
+
+// latency samples in buckets which double in width: bucket 0 holds everything
+// below 1us, bucket i everything in [2^(i-1), 2^i) us and the last one the rest
+class Histogram {
+public:
+  static constexpr int NO_BUCKETS = 25;
+private:
+  std::array<uint64_t, NO_BUCKETS> buckets = {0};
+  uint64_t count_ = 0;
+  double sum = .0;
+  double max_ = .0;
+public:
+  Histogram()
+  {}
+
+  static int bucket_of(double seconds) {
+    double us = seconds * 1e6;
+    if(us < 1.) {
+      return 0;
+    }
+    return std::min(int(std::log2(us)) + 1, NO_BUCKETS - 1);
+  }
+
+  // exclusive upper bound of a bucket in seconds
+  static double upper_bound(int bucket) {
+    return std::ldexp(1e-6, bucket);
+  }
+
+  void add(double seconds) {
+    ++buckets[bucket_of(seconds)];
+    ++count_;
+    sum += seconds;
+    max_ = std::fmax(max_, seconds);
+  }
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  uint64_t bucket(int i) const {
+    return buckets[i];
+  }
+
+  double mean() const {
+    return (count_ == 0) ? .0 : sum / count_;
+  }
+
+  double max() const {
+    return max_;
+  }
+
+  // upper bound of the bucket holding the p-quantile, p in [0, 1]
+  double percentile(double p) const {
+    if(count_ == 0) {
+      return .0;
+    }
+    uint64_t rank = std::ceil(p * count_);
+    uint64_t seen = 0;
+    for(int i = 0; i < NO_BUCKETS; ++i) {
+      seen += buckets[i];
+      if(seen >= rank && seen > 0) {
+        return std::fmin(upper_bound(i), max_);
+      }
+    }
+    return max_;
+  }
+};
+
+struct Counters {
+  uint64_t packets_in = 0;
+  uint64_t bytes_in = 0;
+  uint64_t packets_out = 0;
+  uint64_t bytes_out = 0;
+  // received but not handed on, or not accepted by the outbox
+  uint64_t dropped = 0;
+  uint64_t send_failed = 0;
+};
+
+// what a sender pacing itself estimates about the path to a peer
+struct RateEstimate {
+  // messages per second
+  double rate = .0;
+  // fraction of messages lost
+  double loss = .0;
+  // bytes per second acknowledged
+  double bandwidth = .0;
+};
+
+// traffic of a socket per message type and per peer. per type counters count
+// messages, per peer counters datagrams as they are on the wire
+class Metrics {
+public:
+  // peers beyond this are counted together under 0.0.0.0:0, so that a flood
+  // of spoofed senders can't grow the table without bound
+  static constexpr size_t MAX_PEERS = 1024;
+
+  struct Peer {
+    Counters counters;
+    Histogram rtt;
+    std::optional<RateEstimate> rate;
+  };
+private:
+  struct AtomicCounters {
+    std::atomic<uint64_t> packets_in = 0;
+    std::atomic<uint64_t> bytes_in = 0;
+    std::atomic<uint64_t> packets_out = 0;
+    std::atomic<uint64_t> bytes_out = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> send_failed = 0;
+
+    Counters load() const {
+      return (Counters){
+        .packets_in = packets_in.load(std::memory_order_relaxed),
+        .bytes_in = bytes_in.load(std::memory_order_relaxed),
+        .packets_out = packets_out.load(std::memory_order_relaxed),
+        .bytes_out = bytes_out.load(std::memory_order_relaxed),
+        .dropped = dropped.load(std::memory_order_relaxed),
+        .send_failed = send_failed.load(std::memory_order_relaxed)
+      };
+    }
+  };
+
+  static constexpr size_t NO_TYPES = 256;
+  std::array<AtomicCounters, NO_TYPES> types;
+
+  mutable std::mutex mtx;
+  std::map<uint64_t, Peer> peers_;
+
+  static uint64_t key(uint32_t ip, uint16_t port) {
+    return (uint64_t(ip) << 16) | port;
+  }
+
+  // guarded by mtx
+  Peer &entry(uint32_t ip, uint16_t port) {
+    auto it = peers_.find(key(ip, port));
+    if(it != std::end(peers_)) {
+      return it->second;
+    }
+    if(peers_.size() >= MAX_PEERS) {
+      return peers_[key(0, 0)];
+    }
+    return peers_[key(ip, port)];
+  }
+
+  static void count(std::atomic<uint64_t> &counter, uint64_t n=1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static void write_counters(FILE *file, const Counters &c) {
+    fprintf(file, "\"packets_in\":%lu,\"bytes_in\":%lu,\"packets_out\":%lu,\"bytes_out\":%lu,\"dropped\":%lu,\"send_failed\":%lu",
+      c.packets_in, c.bytes_in, c.packets_out, c.bytes_out, c.dropped, c.send_failed);
+  }
+
+  static void write_histogram(FILE *file, const Histogram &h) {
+    fprintf(file, "{\"count\":%lu,\"mean\":%g,\"p50\":%g,\"p90\":%g,\"p99\":%g,\"max\":%g,\"buckets\":[",
+      h.count(), h.mean(), h.percentile(.5), h.percentile(.9), h.percentile(.99), h.max());
+    for(int i = 0; i < Histogram::NO_BUCKETS; ++i) {
+      fprintf(file, (i == 0) ? "%lu" : ",%lu", h.bucket(i));
+    }
+    fprintf(file, "]}");
+  }
+public:
+  Metrics()
+  {}
+
+  void received_message(uint8_t type, size_t bytes) {
+    count(types[type].packets_in);
+    count(types[type].bytes_in, bytes);
+  }
+
+  void sent_message(uint8_t type, size_t bytes) {
+    count(types[type].packets_out);
+    count(types[type].bytes_out, bytes);
+  }
+
+  void dropped_message(uint8_t type) {
+    count(types[type].dropped);
+  }
+
+  void send_failed_message(uint8_t type) {
+    count(types[type].send_failed);
+  }
+
+  void received_datagram(uint32_t ip, uint16_t port, size_t bytes) {
+    std::lock_guard<std::mutex> guard(mtx);
+    Counters &c = entry(ip, port).counters;
+    ++c.packets_in;
+    c.bytes_in += bytes;
+  }
+
+  void sent_datagram(uint32_t ip, uint16_t port, size_t bytes) {
+    std::lock_guard<std::mutex> guard(mtx);
+    Counters &c = entry(ip, port).counters;
+    ++c.packets_out;
+    c.bytes_out += bytes;
+  }
+
+  void dropped_datagram(uint32_t ip, uint16_t port) {
+    std::lock_guard<std::mutex> guard(mtx);
+    ++entry(ip, port).counters.dropped;
+  }
+
+  void send_failed_datagram(uint32_t ip, uint16_t port) {
+    std::lock_guard<std::mutex> guard(mtx);
+    ++entry(ip, port).counters.send_failed;
+  }
+
+  // round trip times are measured by the protocols on top
+  void rtt(uint32_t ip, uint16_t port, double seconds) {
+    std::lock_guard<std::mutex> guard(mtx);
+    entry(ip, port).rtt.add(seconds);
+  }
+
+  // the latest estimate of the rate control on top
+  void rate(uint32_t ip, uint16_t port, const RateEstimate &estimate) {
+    std::lock_guard<std::mutex> guard(mtx);
+    entry(ip, port).rate = estimate;
+  }
+
+  Counters type(uint8_t type) const {
+    return types[type].load();
+  }
+
+  std::optional<Peer> peer(uint32_t ip, uint16_t port) const {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = peers_.find(key(ip, port));
+    if(it == std::end(peers_)) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // everything so far as members of a json object, without braces:
+  // "types":{"0x10":{...},...},"peers":{"127.0.0.1:5679":{...,"rtt":{...},"rate":{...}},...}
+  void write_json(FILE *file) const {
+    fprintf(file, "\"types\":{");
+    bool first = true;
+    for(size_t t = 0; t < NO_TYPES; ++t) {
+      Counters c = types[t].load();
+      if(c.packets_in == 0 && c.packets_out == 0 && c.dropped == 0 && c.send_failed == 0) {
+        continue;
+      }
+      fprintf(file, "%s\"0x%02lx\":{", first ? "" : ",", t);
+      write_counters(file, c);
+      fprintf(file, "}");
+      first = false;
+    }
+    fprintf(file, "},\"peers\":{");
+    std::lock_guard<std::mutex> guard(mtx);
+    first = true;
+    for(const auto &[k, p] : peers_) {
+      uint32_t ip = k >> 16;
+      uint16_t port = k & 0xffff;
+      fprintf(file, "%s\"%u.%u.%u.%u:%hu\":{", first ? "" : ",",
+        (ip >> 24) & 0xff, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port);
+      write_counters(file, p.counters);
+      if(p.rtt.count() > 0) {
+        fprintf(file, ",\"rtt\":");
+        write_histogram(file, p.rtt);
+      }
+      if(p.rate.has_value()) {
+        fprintf(file, ",\"rate\":{\"rate\":%.1f,\"loss\":%.3f,\"bandwidth\":%.0f}",
+          p.rate->rate, p.rate->loss, p.rate->bandwidth);
+      }
+      fprintf(file, "}");
+      first = false;
+    }
+    fprintf(file, "}");
+  }
+};
+
+}
@@ -2,11 +2,18 @@
 
 #include <cassert>
 #include <cstring>
+#include <cerrno>
 #include <cstdint>
 #include <ctime>
+#include <cmath>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -20,10 +27,20 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <optional>
 #include <type_traits>
+#include <utility>
+#include <tuple>
+#include <array>
+#include <memory>
+#include <atomic>
+#include <thread>
 #include <mutex>
+#include <chrono>
 
 #ifndef TERMINATE
 #include "Debug.hpp"
@@ -32,6 +49,11 @@
 #include "Optimizations.hpp"
 #endif
 #endif
+#include "Timer.hpp"
+#include "Queue.hpp"
+#include "Serialize.hpp"
+#include "Trace.hpp"
+#include "Metrics.hpp"
 
 namespace net {
 
@@ -89,6 +111,198 @@ struct Addr {
   }
 } ATTRIB_PACKED;
 
+// codec of an Addr in NET_FIELDS, as the 32 bits of an ipv4 address and the
+// port
+struct Ipv4 {
+  template <typename V>
+  static constexpr size_t max_bits = 48;
+
+  static void put(BitWriter &writer, const Addr &addr) {
+    ASSERT(addr.ip <= UINT32_MAX);
+    writer.put_bits(addr.ip, 32);
+    writer.put_bits(addr.port, 16);
+  }
+
+  static void get(BitReader &reader, Addr &addr) {
+    addr.ip = reader.get_bits(32);
+    addr.port = reader.get_bits(16);
+  }
+};
+
+typedef uint8_t msgid_t;
+typedef uint8_t channel_t;
+// given out by a server to each of its peers, see Sessions.hpp
+typedef uint16_t session_t;
+
+constexpr session_t NO_SESSION = 0;
+
+// largest single message
+constexpr int MAX_PACKET_SIZE = 256;
+// largest datagram on the wire, a 1500 bytes ethernet frame minus ip and udp
+// headers
+constexpr int MAX_DATAGRAM_SIZE = 1472;
+
+// prepended to every datagram. ids are grouped by protocol, 16 per protocol.
+// the session is the sender's at the receiving end of the channel, if it has
+// one, in little endian
+struct Header {
+  msgid_t id;
+  uint8_t version;
+  session_t session;
+} ATTRIB_PACKED;
+
+// channel 0 carries the transport's own messages. a bundle holds several
+// messages to the same address, each prefixed by its 16 bit length
+constexpr msgid_t BUNDLE_ID = 0x01;
+constexpr uint8_t BUNDLE_VERSION = 1;
+
+// every protocol is served through its own channel
+constexpr channel_t NO_CHANNELS = 4;
+constexpr channel_t ANY_CHANNEL = 0xff;
+
+constexpr channel_t channel_of(msgid_t id) {
+  return id >> 4;
+}
+
+// specialized through NET_MESSAGE for every type sent over a socket
+template <typename T> struct Message;
+
+#define NET_MESSAGE(TYPE, ID, VERSION) \
+  template <> struct net::Message<TYPE> { \
+    static constexpr net::msgid_t id = ID; \
+    static constexpr uint8_t version = VERSION; \
+    static constexpr bool variable = false; \
+  };
+
+// only the first data.size() bytes of a variable message are sent, the rest
+// of the struct is zeroed on the receiving side
+#define NET_MESSAGE_VARIABLE(TYPE, ID, VERSION) \
+  template <> struct net::Message<TYPE> { \
+    static constexpr net::msgid_t id = ID; \
+    static constexpr uint8_t version = VERSION; \
+    static constexpr bool variable = true; \
+  };
+
+// messages which the next one of the same type supersedes, like snapshots.
+// a socket which can't keep up drops them, everything else waits until it can
+// be sent
+template <typename T>
+struct Droppable : std::false_type {};
+
+#define NET_DROPPABLE(TYPE) \
+  template <> struct net::Droppable<TYPE> : std::true_type {};
+
+// what a droppable message is a copy of. a newer one replaces a queued one to
+// the same address with the same id and key, none is a copy of nothing. all
+// messages of a type are copies of the same thing unless NET_DROPPABLE_KEY
+// tells them apart
+template <typename T>
+struct DropKey {
+  static std::optional<uint32_t> of(const T &) {
+    return 0;
+  }
+};
+
+#define NET_DROPPABLE_KEY(TYPE, FUNC) \
+  template <> struct net::DropKey<TYPE> { \
+    static std::optional<uint32_t> of(const TYPE &data) { \
+      return FUNC(data); \
+    } \
+  };
+
+// whether a datagram may be dropped and what it replaces. bundles mix
+// messages and replace nothing
+struct Drop {
+  bool droppable = false;
+  std::optional<uint32_t> key;
+
+  template <typename T>
+  static Drop of(const T &data) {
+    if constexpr(Droppable<T>::value) {
+      return (Drop){ .droppable = true, .key = DropKey<T>::of(data) };
+    } else {
+      return Drop();
+    }
+  }
+};
+
+template <typename T>
+struct Frame {
+  Header header = {
+    .id = Message<T>::id,
+    .version = Message<T>::version,
+    .session = NO_SESSION
+  };
+  T data;
+
+  Frame(const T data, session_t session=NO_SESSION):
+    data(data)
+  {
+    header.session = htole16(session);
+  }
+} ATTRIB_PACKED;
+
+// number of bytes of a Frame<T> which go on the wire
+template <typename T>
+constexpr size_t frame_size(const T &data) {
+  if constexpr(Message<T>::variable) {
+    return sizeof(Header) + std::min(data.size(), sizeof(T));
+  } else {
+    return sizeof(Frame<T>);
+  }
+}
+
+// most bytes a T takes on the wire after the header
+template <typename T>
+constexpr size_t max_wire_size() {
+  if constexpr(has_fields_v<T>) {
+    return (Fields<T>::type::max_bits + 7) / 8;
+  } else {
+    return sizeof(T);
+  }
+}
+
+// a message as it is sent: the header followed by the fields NET_FIELDS
+// describes for T, or by T as it is in memory if there is no description
+template <typename T>
+class WireFrame {
+  uint8_t bytes_[sizeof(Header) + max_wire_size<T>()];
+  size_t size_;
+public:
+  WireFrame(const T &data, session_t session=NO_SESSION) {
+    static_assert(sizeof(bytes_) <= MAX_PACKET_SIZE);
+    if constexpr(has_fields_v<T>) {
+      Header hdr = {
+        .id = Message<T>::id,
+        .version = Message<T>::version,
+        .session = htole16(session)
+      };
+      memcpy(bytes_, &hdr, sizeof(Header));
+      BitWriter writer(bytes_ + sizeof(Header), max_wire_size<T>());
+      Fields<T>::type::encode(writer, data);
+      ASSERT(writer.ok());
+      size_ = sizeof(Header) + writer.size();
+    } else {
+      Frame<T> frame(data, session);
+      size_ = frame_size(data);
+      memcpy(bytes_, &frame, size_);
+    }
+  }
+
+  void set_session(session_t session) {
+    const session_t le = htole16(session);
+    memcpy(bytes_ + offsetof(Header, session), &le, sizeof(session_t));
+  }
+
+  const void *data() const {
+    return bytes_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+};
+
 template <typename T>
 struct Package {
   Addr addr;
@@ -112,9 +326,98 @@ decltype(auto) make_package(const net::Addr addr, const T data) {
   return Package<T>(addr, data);
 }
 
-struct Blob {
+// typed access shared by owning and borrowed datagrams
+template <typename B>
+struct BlobVisitor {
+  std::optional<Header> header() const {
+    const B &blob = static_cast<const B &>(*this);
+    if(blob.size() < sizeof(Header)) {
+      return std::nullopt;
+    }
+    Header hdr;
+    memcpy(&hdr, blob.data(), sizeof(Header));
+    return hdr;
+  }
+
+  // the sender's session as it claims, to be checked against its address
+  session_t session() const {
+    auto hdr = header();
+    return hdr.has_value() ? le16toh(hdr->session) : NO_SESSION;
+  }
+
+  template <typename T>
+  bool is() const {
+    const B &blob = static_cast<const B &>(*this);
+    auto hdr = header();
+    if(!hdr.has_value() || hdr->id != Message<T>::id || hdr->version != Message<T>::version) {
+      return false;
+    }
+    if constexpr(has_fields_v<T>) {
+      return blob.size() <= sizeof(Header) + max_wire_size<T>();
+    } else if constexpr(Message<T>::variable) {
+      return blob.size() <= sizeof(Frame<T>);
+    } else {
+      return blob.size() == sizeof(Frame<T>);
+    }
+  }
+
+  const void *payload() const {
+    const B &blob = static_cast<const B &>(*this);
+    return (const uint8_t *)blob.data() + sizeof(Header);
+  }
+
+  // into t, which is left zeroed where the message does not say otherwise.
+  // false if the payload is not a valid T
+  template <typename T>
+  bool decode(T &t) const {
+    static_assert(has_fields_v<T>);
+    const B &blob = static_cast<const B &>(*this);
+    memset((void *)&t, 0x00, sizeof(T));
+    BitReader reader(payload(), blob.size() - sizeof(Header));
+    Fields<T>::type::decode(reader, t);
+    return reader.done();
+  }
+
+  // func gets a copy of the message, decoded if it has NET_FIELDS. the size
+  // is checked once by cond
+  template <typename T, typename F, typename CF>
+  bool try_visit_as(F &&func, CF &&cond) const {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const B &blob = static_cast<const B &>(*this);
+    if(!cond(blob) || blob.size() < sizeof(Header)) {
+      return false;
+    }
+    if constexpr(has_fields_v<T>) {
+      T t;
+      if(!decode(t)) {
+        return false;
+      }
+      func(std::as_const(t));
+      return true;
+    }
+    const size_t len = std::min(blob.size() - sizeof(Header), sizeof(T));
+    T t;
+    if(len < sizeof(T)) {
+      memset((void *)&t, 0x00, sizeof(T));
+    }
+    std::copy_n((const uint8_t *)payload(), len, (uint8_t *)&t);
+    func(std::as_const(t));
+    return true;
+  }
+
+  template <typename T, typename F>
+  bool try_visit_as(F &&func) const {
+    return try_visit_as<T>(std::forward<F>(func), [&](const B &blob) {
+      return blob.template is<T>();
+    });
+  }
+};
+
+struct Blob : BlobVisitor<Blob> {
   Addr addr;
   std::vector<uint8_t> data_;
+  // when the datagram arrived in Timer::system_time(), negative if unknown
+  Timer::time_t arrival = -1.;
 
   Blob():
     addr(), data_()
@@ -122,9 +425,10 @@ struct Blob {
 
   template <typename T>
   Blob(Package<T> package):
-    addr(package.addr), data_(sizeof(T))
+    addr(package.addr), data_()
   {
-    memcpy(data(), package.data, sizeof(T));
+    WireFrame<T> frame(package.data);
+    data_.assign((const uint8_t *)frame.data(), (const uint8_t *)frame.data() + frame.size());
   }
 
   size_t size() const {
@@ -144,33 +448,475 @@ struct Blob {
   }
 
   template <typename T>
-  operator Package<T>() {
-    ASSERT(sizeof(T) == size());
+  operator Package<T>() const {
+    ASSERT(is<T>());
     Package<T> packet;
     packet.addr = addr;
-    memcpy(&packet.data, data(), sizeof(T));
+    if constexpr(has_fields_v<T>) {
+      const bool valid = decode(packet.data);
+      ASSERT(valid);
+    } else {
+      memset((void *)&packet.data, 0x00, sizeof(T));
+      memcpy((void *)&packet.data, payload(), std::min(size() - sizeof(Header), sizeof(T)));
+    }
     return packet;
   }
+};
 
-  template <typename T, typename F, typename CF>
-  bool try_visit_as(F &&func, CF &&cond) const {
-    if(!cond(*this)) {
+// datagram borrowed from a socket's packet ring. it is only valid until the
+// handler it was passed to returns
+struct BlobView : BlobVisitor<BlobView> {
+  Addr addr;
+  const uint8_t *data_;
+  size_t size_;
+  Timer::time_t arrival;
+
+  BlobView(Addr addr, const uint8_t *data, size_t size, Timer::time_t arrival=-1.):
+    addr(addr), data_(data), size_(size), arrival(arrival)
+  {}
+
+  BlobView(const Blob &blob):
+    addr(blob.addr), data_((const uint8_t *)blob.data()), size_(blob.size()), arrival(blob.arrival)
+  {}
+
+  // arrival time, now if it is unknown
+  Timer::time_t arrived() const {
+    return (arrival < .0) ? Timer::system_time() : arrival;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const void *data() const {
+    return data_;
+  }
+
+  operator Blob() const {
+    Blob blob;
+    blob.addr = addr;
+    blob.data_.assign(data_, data_ + size_);
+    blob.arrival = arrival;
+    return blob;
+  }
+};
+
+// fixed-size copy of a datagram, queued between the i/o thread and the actors
+template <size_t Capacity = MAX_DATAGRAM_SIZE>
+struct Datagram {
+  Addr addr;
+  uint16_t size = 0;
+  Timer::time_t arrival = -1.;
+  uint8_t data[Capacity];
+
+  void assign(const Addr &to, const void *bytes, size_t len, Timer::time_t at=-1.) {
+    ASSERT(len <= Capacity);
+    addr = to;
+    size = len;
+    arrival = at;
+    memcpy(data, bytes, len);
+  }
+
+  BlobView view() const {
+    return BlobView(addr, data, size, arrival);
+  }
+};
+
+// collects messages per destination and turns them into as few datagrams as
+// the mtu allows
+class Bundler {
+  struct Bundle {
+    std::vector<uint8_t> data;
+    int no_messages = 0;
+    // droppable only if every message in it is
+    Drop drop;
+  };
+
+  std::map<Addr, Bundle> bundles;
+  size_t mtu_ = MAX_DATAGRAM_SIZE;
+public:
+  Bundler()
+  {}
+
+  void set_mtu(size_t mtu) {
+    ASSERT(mtu >= sizeof(Header) + sizeof(uint16_t) + MAX_PACKET_SIZE && mtu <= MAX_DATAGRAM_SIZE);
+    mtu_ = mtu;
+  }
+
+  size_t mtu() const {
+    return mtu_;
+  }
+
+  // send_func(addr, data, size, drop) is called when the bundle for addr is
+  // full
+  template <typename F>
+  void add(const Addr &addr, const void *frame, uint16_t len, const Drop &drop, F &&send_func) {
+    Bundle &bundle = bundles[addr];
+    if(bundle.no_messages > 0 && bundle.data.size() + sizeof(uint16_t) + len > mtu_) {
+      flush(addr, bundle, send_func);
+    }
+    if(bundle.no_messages == 0) {
+      // the messages in a bundle carry their own sessions
+      Header hdr = { .id = BUNDLE_ID, .version = BUNDLE_VERSION, .session = NO_SESSION };
+      bundle.data.resize(sizeof(Header));
+      memcpy(bundle.data.data(), &hdr, sizeof(Header));
+    }
+    size_t offset = bundle.data.size();
+    bundle.data.resize(offset + sizeof(uint16_t) + len);
+    const uint16_t le_len = htole16(len);
+    memcpy(&bundle.data[offset], &le_len, sizeof(uint16_t));
+    memcpy(&bundle.data[offset + sizeof(uint16_t)], frame, len);
+    bundle.drop = (bundle.no_messages == 0) ? drop : (Drop){ .droppable = bundle.drop.droppable && drop.droppable, .key = std::nullopt };
+    ++bundle.no_messages;
+  }
+
+  template <typename F>
+  void flush(F &&send_func) {
+    for(auto &[addr, bundle] : bundles) {
+      flush(addr, bundle, send_func);
+    }
+  }
+
+  template <typename F>
+  void flush(const Addr &addr, F &&send_func) {
+    auto it = bundles.find(addr);
+    if(it != std::end(bundles)) {
+      flush(addr, it->second, send_func);
+    }
+  }
+
+private:
+  // a bundle of one goes out as a plain message
+  template <typename F>
+  static void flush(const Addr &addr, Bundle &bundle, F &&send_func) {
+    if(bundle.no_messages == 1) {
+      const size_t skip = sizeof(Header) + sizeof(uint16_t);
+      send_func(addr, &bundle.data[skip], bundle.data.size() - skip, bundle.drop);
+    } else if(bundle.no_messages > 1) {
+      send_func(addr, bundle.data.data(), bundle.data.size(), bundle.drop);
+    }
+    bundle.data.clear();
+    bundle.no_messages = 0;
+    bundle.drop = Drop();
+  }
+};
+
+// errors after which sending again later may succeed
+inline bool would_block() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+}
+
+// datagrams the kernel had no room for, sent again once the socket becomes
+// writable. droppable ones only get a part of the queue, and a newer one
+// replaces an older copy of the same thing, as told by its Drop
+class SendQueue {
+public:
+  static constexpr size_t CAPACITY = 1024;
+  static constexpr size_t DROPPABLE_CAPACITY = 256;
+
+  struct Entry {
+    Datagram<> dgram;
+    Drop drop;
+  };
+
+  enum class Result {
+    QUEUED, REPLACED, DROPPED
+  };
+private:
+  static constexpr int BATCH_SIZE = 32;
+
+  std::deque<Entry> entries;
+  size_t no_droppable = 0;
+
+  void pop() {
+    no_droppable -= entries.front().drop.droppable;
+    entries.pop_front();
+  }
+public:
+  SendQueue()
+  {}
+
+  bool empty() const {
+    return entries.empty();
+  }
+
+  size_t size() const {
+    return entries.size();
+  }
+
+  Result push(const Addr &addr, const void *data, size_t len, const Drop &drop) {
+    if(drop.droppable) {
+      const msgid_t id = *(const msgid_t *)data;
+      for(Entry &e : entries) {
+        if(drop.key.has_value() && e.drop.key == drop.key && e.dgram.addr == addr && e.dgram.data[0] == id) {
+          e.dgram.assign(addr, data, len);
+          return Result::REPLACED;
+        }
+      }
+      if(no_droppable >= DROPPABLE_CAPACITY) {
+        return Result::DROPPED;
+      }
+    }
+    if(entries.size() >= CAPACITY) {
+      return Result::DROPPED;
+    }
+    entries.emplace_back();
+    entries.back().dgram.assign(addr, data, len);
+    entries.back().drop = drop;
+    no_droppable += drop.droppable;
+    return Result::QUEUED;
+  }
+
+  // sends from the front until the socket would block. transmit_func(msgs, n)
+  // behaves like sendmmsg, failed_func(entry) gets those which can't be sent
+  template <typename F, typename G>
+  void send(F &&transmit_func, G &&failed_func) {
+    sockaddr_in addrs[BATCH_SIZE];
+    iovec iovs[BATCH_SIZE];
+    mmsghdr msgs[BATCH_SIZE];
+    while(!entries.empty()) {
+      const int no_msgs = std::min<size_t>(entries.size(), BATCH_SIZE);
+      for(int i = 0; i < no_msgs; ++i) {
+        const Datagram<> &dgram = entries[i].dgram;
+        addrs[i] = dgram.addr;
+        iovs[i].iov_base = (void *)dgram.data;
+        iovs[i].iov_len = dgram.size;
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      int sent = transmit_func(msgs, no_msgs);
+      if(sent < 0) {
+        if(would_block()) {
+          errno = 0;
+          return;
+        }
+        errno = 0;
+        failed_func(entries.front());
+        pop();
+        continue;
+      }
+      for(int i = 0; i < sent; ++i) {
+        pop();
+      }
+    }
+  }
+};
+
+// checks that the length prefixes of a bundle add up to its size
+inline bool is_valid_bundle(const uint8_t *data, size_t size) {
+  size_t offset = sizeof(Header);
+  while(offset < size) {
+    uint16_t len;
+    if(offset + sizeof(uint16_t) > size) {
       return false;
     }
-    T t;
-    memcpy(&t, data(), sizeof(T));
-    func(t);
-    return true;
+    memcpy(&len, &data[offset], sizeof(uint16_t));
+    len = le16toh(len);
+    offset += sizeof(uint16_t);
+    if(len < sizeof(Header) || len > MAX_PACKET_SIZE || offset + len > size) {
+      return false;
+    }
+    offset += len;
   }
+  return offset == size && size > sizeof(Header);
+}
 
-  template <typename T, typename F>
-  bool try_visit_as(F &&func) const {
-    return try_visit_as<T>(std::forward<F>(func), [&](const Blob &blob) {
-      return blob.size() == sizeof(T);
-    });
+// fixed-size slots filled by a single recvmmsg call. packets are handed out in
+// the order they arrived, one message at a time for bundles, and the ring is
+// only refilled once it has been drained
+template <size_t Capacity, size_t SlotSize>
+class PacketRing {
+  static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(timespec));
+
+  uint8_t slots[Capacity][SlotSize];
+  size_t sizes[Capacity];
+  sockaddr_in addrs[Capacity];
+  Timer::time_t arrivals[Capacity];
+  mmsghdr msgs[Capacity];
+  iovec iovs[Capacity];
+  alignas(cmsghdr) uint8_t controls[Capacity][CONTROL_SIZE];
+  size_t head = 0, tail = 0;
+  // position of the current message within a bundle at head, 0 otherwise
+  size_t offset = 0;
+
+  static bool is_bundle(const uint8_t *data, size_t size) {
+    return size >= sizeof(Header) && data[0] == BUNDLE_ID && data[1] == BUNDLE_VERSION;
+  }
+
+  void settle() {
+    offset = (!empty() && is_bundle(slots[head], sizes[head])) ? sizeof(Header) : 0;
+  }
+
+  // the kernel's receive timestamp if there is one
+  static Timer::time_t arrival_of(msghdr &hdr, Timer::time_t fallback) {
+    for(cmsghdr *c = CMSG_FIRSTHDR(&hdr); c != nullptr; c = CMSG_NXTHDR(&hdr, c)) {
+      if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+        timespec ts;
+        memcpy(&ts, CMSG_DATA(c), sizeof(timespec));
+        auto since_epoch = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        return Timer::system_time(std::chrono::system_clock::time_point(
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(since_epoch)));
+      }
+    }
+    return fallback;
+  }
+public:
+  PacketRing() {
+    for(size_t i = 0; i < Capacity; ++i) {
+      iovs[i].iov_base = slots[i];
+      iovs[i].iov_len = SlotSize;
+    }
+  }
+
+  bool empty() const {
+    return head == tail;
+  }
+
+  size_t size() const {
+    return tail - head;
+  }
+
+  // recv_func(msgs, n) is expected to behave like recvmmsg. returns the number
+  // of datagrams received, -1 on error
+  template <typename F>
+  int fill(F &&recv_func) {
+    ASSERT(empty());
+    head = tail = 0;
+    for(size_t i = 0; i < Capacity; ++i) {
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = controls[i];
+      msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    }
+    int received = recv_func(msgs, Capacity);
+    if(received <= 0) {
+      return received;
+    }
+    // without kernel timestamps datagrams arrived at the latest by now
+    const Timer::time_t now = Timer::system_time();
+    for(int i = 0; i < received; ++i) {
+      // drop datagrams which did not fit into a slot and malformed bundles
+      if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        continue;
+      }
+      if(is_bundle(slots[i], msgs[i].msg_len) && !is_valid_bundle(slots[i], msgs[i].msg_len)) {
+        continue;
+      }
+      sizes[tail] = msgs[i].msg_len;
+      arrivals[tail] = arrival_of(msgs[i].msg_hdr, now);
+      if(size_t(i) != tail) {
+        memcpy(slots[tail], slots[i], sizes[tail]);
+        addrs[tail] = addrs[i];
+      }
+      ++tail;
+    }
+    settle();
+    return received;
+  }
+
+  BlobView front() const {
+    ASSERT(!empty());
+    if(offset == 0) {
+      return BlobView(Addr(addrs[head]), slots[head], sizes[head], arrivals[head]);
+    }
+    uint16_t len;
+    memcpy(&len, &slots[head][offset], sizeof(uint16_t));
+    len = le16toh(len);
+    return BlobView(Addr(addrs[head]), &slots[head][offset + sizeof(uint16_t)], len, arrivals[head]);
+  }
+
+  void pop() {
+    ASSERT(!empty());
+    if(offset != 0) {
+      uint16_t len;
+      memcpy(&len, &slots[head][offset], sizeof(uint16_t));
+      offset += sizeof(uint16_t) + le16toh(len);
+      if(offset < sizes[head]) {
+        return;
+      }
+    }
+    ++head;
+    settle();
+  }
+};
+
+// where the datagrams of a socket go. handles returned by open() have to be
+// pollable and readable whenever datagrams are waiting; send and receive
+// behave like the non-blocking sendmmsg and recvmmsg
+class Transport {
+public:
+  virtual ~Transport()
+  {}
+
+  virtual int open(port_t port) = 0;
+  virtual void close(int handle) = 0;
+  virtual int send(int handle, mmsghdr *msgs, unsigned no_msgs) = 0;
+  virtual int receive(int handle, mmsghdr *msgs, unsigned no_msgs) = 0;
+  // for transports which queue what send() accepted, gets it under way. the
+  // socket calls it once per flush, receiving may do so as well
+  virtual void submit(int)
+  {}
+};
+
+class KernelTransport : public Transport {
+public:
+  KernelTransport()
+  {}
+
+  int open(port_t port) {
+    int handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(handle <= 0) {
+      perror("error");
+      TERMINATE("Can't create socket\n");
+    }
+
+    sockaddr_in address = Addr(INADDR_ANY, port);
+
+    if(bind(handle, (const sockaddr *)&address, sizeof(sockaddr_in)) < 0) {
+      perror("error");
+      TERMINATE("Can't bind socket\n");
+    }
+
+    int nonBlocking = 1;
+    if(fcntl(handle, F_SETFL, O_NONBLOCK, nonBlocking) == -1) {
+      perror("error");
+      TERMINATE("Can't set non-blocking socket\n");
+    }
+
+    // receive timestamps, datagrams are stamped with the time they are read
+    // from the socket otherwise
+    int timestamps = 1;
+    if(setsockopt(handle, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps)) == -1) {
+      Logger::Warning("socket: no kernel receive timestamps on port %hu\n", port);
+      errno = 0;
+    }
+    return handle;
+  }
+
+  void close(int handle) {
+    ::close(handle);
+  }
+
+  int send(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    return sendmmsg(handle, msgs, no_msgs, 0);
+  }
+
+  int receive(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    return recvmmsg(handle, msgs, no_msgs, MSG_DONTWAIT, nullptr);
   }
 };
 
+inline Transport &kernel_transport() {
+  static KernelTransport kernel;
+  return kernel;
+}
+
 enum class SocketType {
   ICMP,
   UDP,
@@ -280,101 +1026,937 @@ template <SocketType Proto> class Socket;
 
 template <>
 class Socket<SocketType::UDP> {
-  static constexpr int MAX_PACKET_SIZE = 256;
-
+public:
+  // in both modes datagrams are demultiplexed by the channel of their header
+  // into one inbox per channel, so that every protocol can be served by its
+  // own thread without losing the datagrams of the others
+  enum class Mode {
+    // every thread calls into the kernel itself. whoever reads the socket
+    // stashes datagrams of other channels in their inboxes
+    DIRECT,
+    // a dedicated thread owns the descriptor, other threads only touch the
+    // lock-free outbox and their channel's inbox
+    IO_THREAD
+  };
+private:
+  // datagrams pulled from the kernel per recvmmsg call
+  static constexpr int BATCH_SIZE = 32;
+  static constexpr size_t OUTBOX_SIZE = 512;
+  static constexpr size_t INBOX_SIZE = 256;
+  // upper bound on a single sleep in listen, so that state flags set by other
+  // threads without calling wakeup() are still noticed in time
+  static constexpr Timer::time_t MAX_WAIT = .1;
+
+  Transport &transport_;
   int handle_;
+  int epoll_;
+  int event_;
   port_t port_;
-  std::mutex mtx;
+  Mode mode_;
+  std::mutex send_mtx;
+  std::mutex recv_mtx;
+  PacketRing<BATCH_SIZE, MAX_DATAGRAM_SIZE> ring;
+  // reused by broadcast, guarded by send_mtx
+  std::vector<sockaddr_in> send_addrs;
+  std::vector<iovec> send_iovs;
+  std::vector<mmsghdr> send_msgs;
+  std::vector<uint8_t> send_frames;
+  std::mutex bundle_mtx;
+  Bundler bundler;
+
+  // a single consumer per channel. producers are the i/o thread or, in direct
+  // mode, whichever thread holds recv_mtx
+  struct Inbox {
+    SPSCQueue<Datagram<MAX_PACKET_SIZE>, INBOX_SIZE> queue;
+    int event = -1;
+    std::atomic<size_t> dropped = 0;
+    // senders the channel accepts, everyone if null
+    std::shared_ptr<const std::set<Addr>> peers;
+  };
+  std::unique_ptr<Inbox[]> inboxes;
+
+  // datagrams waiting for the socket to become writable, guarded by send_mtx
+  SendQueue backlog;
+  std::atomic<size_t> backlog_size = 0;
+  std::atomic<size_t> backlog_replaced = 0;
+  std::atomic<size_t> backlog_dropped = 0;
+  bool watching_writable = false;
+
+  // i/o thread mode only
+  std::unique_ptr<MPSCQueue<SendQueue::Entry, OUTBOX_SIZE>> outbox;
+  std::unique_ptr<SendQueue::Entry[]> send_batch;
+  std::thread io_thread;
+  std::atomic<bool> io_stop = false;
+
+  // sessions servers gave this socket, stamped into what is sent to them on
+  // their channel. replaced as a whole under session_mtx, null while empty
+  typedef std::map<std::pair<Addr, channel_t>, session_t> SessionMap;
+  std::shared_ptr<const SessionMap> sessions_;
+  std::mutex session_mtx;
+
+  // datagrams are recorded while set
+  std::shared_ptr<TraceWriter> trace_;
+  Metrics metrics_;
 public:
-  Socket(port_t port):
-    port_(port)
+  Socket(port_t port, Mode mode=Mode::DIRECT, Transport &transport=kernel_transport()):
+    transport_(transport), port_(port), mode_(mode)
   {
-    std::lock_guard<std::mutex> guard(mtx);
-    handle_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if(handle_ <= 0) {
+    handle_ = transport_.open(port_);
+
+    event_ = eventfd(0, EFD_NONBLOCK);
+    if(event_ == -1) {
       perror("error");
-      TERMINATE("Can't create socket\n");
+      TERMINATE("Can't create wakeup event\n");
     }
 
-    sockaddr_in address = Addr(INADDR_ANY, port_);
-
-    if(bind(handle_, (const sockaddr *)&address, sizeof(sockaddr_in)) < 0) {
+    epoll_ = epoll_create1(0);
+    if(epoll_ == -1) {
       perror("error");
-      TERMINATE("Can't bind socket\n");
+      TERMINATE("Can't create epoll instance\n");
     }
 
-    int nonBlocking = 1;
-    if(fcntl(handle_, F_SETFL, O_NONBLOCK, nonBlocking) == -1) {
-      perror("error");
-      TERMINATE("Can't set non-blocking socket\n");
+    for(int fd : {handle_, event_}) {
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if(epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("error");
+        TERMINATE("Can't register socket with epoll\n");
+      }
+    }
+
+    inboxes.reset(new Inbox[NO_CHANNELS]);
+    for(channel_t c = 0; c < NO_CHANNELS; ++c) {
+      inboxes[c].event = eventfd(0, EFD_NONBLOCK);
+      if(inboxes[c].event == -1) {
+        perror("error");
+        TERMINATE("Can't create inbox event\n");
+      }
+    }
+
+    if(mode_ == Mode::IO_THREAD) {
+      outbox.reset(new MPSCQueue<SendQueue::Entry, OUTBOX_SIZE>());
+      send_batch.reset(new SendQueue::Entry[BATCH_SIZE]);
+      io_thread = std::thread([this]() mutable {
+        run_io();
+      });
     }
   }
 
   ~Socket() {
-    close(handle_);
+    if(mode_ == Mode::IO_THREAD) {
+      io_stop = true;
+      notify(event_);
+      io_thread.join();
+    }
+    for(channel_t c = 0; c < NO_CHANNELS; ++c) {
+      close(inboxes[c].event);
+    }
+    close(epoll_);
+    close(event_);
+    transport_.close(handle_);
+  }
+
+  constexpr Mode mode() const {
+    return mode_;
   }
 
   template <typename T>
   void send(const Package<T> package) {
-    std::lock_guard<std::mutex> guard(mtx);
-    if(sizeof(T) > MAX_PACKET_SIZE) {
-      perror("error");
-      TERMINATE("The packet to be sent is too big\n");
+    WireFrame<T> frame(package.data, session_of(package.addr, channel_of(Message<T>::id)));
+    const size_t len = frame.size();
+
+    if(mode_ == Mode::IO_THREAD) {
+      if(!enqueue(package.addr, frame.data(), len, Drop::of(package.data))) {
+        Logger::Warning("socket: outbox full, dropped packet to %s\n", package.addr.to_str().c_str());
+        metrics_.dropped_message(Message<T>::id);
+        metrics_.dropped_datagram(package.addr.ip, package.addr.port);
+      } else {
+        metrics_.sent_message(Message<T>::id, len);
+      }
+      notify(event_);
+      return;
     }
 
-    sockaddr_in address = package.addr;
+    std::lock_guard<std::mutex> guard(send_mtx);
+    if(send_or_defer(package.addr, frame.data(), len, Drop::of(package.data))) {
+      metrics_.sent_message(Message<T>::id, len);
+    }
+  }
 
-    int sent_bytes = sendto(handle_, &package.data, sizeof(T), 0, (sockaddr *) &address, sizeof(sockaddr_in));
+  // sends the same payload to every address in addrs with as few sendmmsg
+  // calls as possible. returns the addresses it could not be sent to or queue
+  // for later; in i/o thread mode only those which did not fit into the outbox
+  template <typename T, typename C>
+  std::vector<Addr> broadcast(const C &addrs, const T data) {
+    WireFrame<T> frame(data);
+    const size_t len = frame.size();
+    const Drop drop = Drop::of(data);
+    auto sessions = std::atomic_load(&sessions_);
+
+    std::vector<Addr> failed;
+    if(mode_ == Mode::IO_THREAD) {
+      for(const Addr &addr : addrs) {
+        frame.set_session(session_of(sessions, addr, channel_of(Message<T>::id)));
+        if(!enqueue(addr, frame.data(), len, drop)) {
+          failed.push_back(addr);
+          metrics_.dropped_message(Message<T>::id);
+          metrics_.dropped_datagram(addr.ip, addr.port);
+        } else {
+          metrics_.sent_message(Message<T>::id, len);
+        }
+      }
+      notify(event_);
+      return failed;
+    }
 
-    if(sent_bytes != sizeof(T)) {
-      std::cout << package.addr.to_str() << std::endl;
-      perror("error");
-      TERMINATE("Can't send packet\n");
+    std::lock_guard<std::mutex> guard(send_mtx);
+    send_addrs.clear();
+    for(const Addr &addr : addrs) {
+      send_addrs.push_back(addr);
     }
+    send_msgs.resize(send_addrs.size());
+    send_iovs.resize(send_addrs.size());
+    // frames differ in their sessions, every address gets a copy of its own
+    if(sessions != nullptr) {
+      send_frames.resize(send_addrs.size() * len);
+      for(size_t i = 0; i < send_addrs.size(); ++i) {
+        frame.set_session(session_of(sessions, Addr(send_addrs[i]), channel_of(Message<T>::id)));
+        memcpy(&send_frames[i * len], frame.data(), len);
+      }
+    }
+    auto frame_of = [&](size_t i) -> const void * {
+      return (sessions != nullptr) ? (const void *)&send_frames[i * len] : frame.data();
+    };
+
+    // nothing overtakes what is already waiting
+    retry_backlog();
+    if(!backlog.empty()) {
+      for(size_t i = 0; i < send_addrs.size(); ++i) {
+        if(!defer(Addr(send_addrs[i]), frame_of(i), len, drop)) {
+          failed.push_back(Addr(send_addrs[i]));
+        }
+      }
+      for(size_t j = 0; j < send_addrs.size() - failed.size(); ++j) {
+        metrics_.sent_message(Message<T>::id, len);
+      }
+      return failed;
+    }
+
+    for(size_t i = 0; i < send_addrs.size(); ++i) {
+      send_iovs[i] = { .iov_base = (void *)frame_of(i), .iov_len = len };
+      memset(&send_msgs[i], 0, sizeof(mmsghdr));
+      send_msgs[i].msg_hdr.msg_name = &send_addrs[i];
+      send_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      send_msgs[i].msg_hdr.msg_iov = &send_iovs[i];
+      send_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t i = 0;
+    while(i < send_msgs.size()) {
+      int sent = transmit(&send_msgs[i], std::min<size_t>(send_msgs.size() - i, UIO_MAXIOV));
+      if(sent < 0 && would_block()) {
+        // the rest waits for the socket to become writable
+        errno = 0;
+        for(; i < send_addrs.size(); ++i) {
+          if(!defer(Addr(send_addrs[i]), frame_of(i), len, drop)) {
+            failed.push_back(Addr(send_addrs[i]));
+          }
+        }
+        break;
+      } else if(sent < 0) {
+        // the first message of the remaining batch could not be sent, skip it
+        failed.push_back(Addr(send_addrs[i]));
+        metrics_.send_failed_message(Message<T>::id);
+        errno = 0;
+        ++i;
+        continue;
+      }
+      for(int j = 0; j < sent; ++j) {
+        if(send_msgs[i + j].msg_len != len) {
+          failed.push_back(Addr(send_addrs[i + j]));
+          metrics_.send_failed_message(Message<T>::id);
+        }
+      }
+      i += sent;
+    }
+    for(size_t j = 0; j < send_addrs.size() - failed.size(); ++j) {
+      metrics_.sent_message(Message<T>::id, len);
+    }
+    return failed;
   }
 
-  std::optional<Blob> receive() {
-    std::lock_guard<std::mutex> guard(mtx);
-    sockaddr_in saddr_from;
-    socklen_t saddr_from_length = sizeof(saddr_from);
+  // queues a message to be sent with others to the same address in a single
+  // datagram on the next flush()
+  template <typename T>
+  void bundle(const Package<T> package) {
+    WireFrame<T> frame(package.data, session_of(package.addr, channel_of(Message<T>::id)));
+    const size_t len = frame.size();
+    metrics_.sent_message(Message<T>::id, len);
+    std::lock_guard<std::mutex> guard(bundle_mtx);
+    bundler.add(package.addr, frame.data(), len, Drop::of(package.data), [&](const Addr &addr, const void *data, size_t len, const Drop &drop) mutable {
+      send_datagram(addr, data, len, drop);
+    });
+  }
 
-    Blob blob;
-    blob.resize(MAX_PACKET_SIZE);
+  template <typename T, typename C>
+  void bundle(const C &addrs, const T data) {
+    for(const Addr &addr : addrs) {
+      bundle(make_package(addr, data));
+    }
+  }
+
+  // sends out all pending bundles and retries what waits for the socket to
+  // become writable, meant to be called once per tick
+  void flush() {
+    std::lock_guard<std::mutex> guard(bundle_mtx);
+    bundler.flush([&](const Addr &addr, const void *data, size_t len, const Drop &drop) mutable {
+      send_datagram(addr, data, len, drop);
+    });
+    retry();
+    if(mode_ == Mode::DIRECT) {
+      transport_.submit(handle_);
+    }
+  }
+
+  // sends out the pending bundle to addr alone, so that what is bundled next
+  // starts a datagram of its own
+  void flush(const Addr &addr) {
+    std::lock_guard<std::mutex> guard(bundle_mtx);
+    bundler.flush(addr, [&](const Addr &to, const void *data, size_t len, const Drop &drop) mutable {
+      send_datagram(to, data, len, drop);
+    });
+  }
+
+  // retries what waits for the socket to become writable. the i/o thread does
+  // so by itself
+  void retry() {
+    if(mode_ == Mode::IO_THREAD) {
+      notify(event_);
+    } else {
+      std::lock_guard<std::mutex> guard(send_mtx);
+      retry_backlog();
+    }
+  }
 
-    int received_bytes = recvfrom(handle_, blob.data(), MAX_PACKET_SIZE, 0, (sockaddr *)&saddr_from, &saddr_from_length);
+  void set_mtu(size_t mtu) {
+    std::lock_guard<std::mutex> guard(bundle_mtx);
+    bundler.set_mtu(mtu);
+  }
 
-    if(received_bytes <= 0) {
-      return std::optional<Blob>();
+  // passes the next datagram to func without copying it out of the ring,
+  // refilling the ring with a single recvmmsg call once it is drained
+  template <typename F>
+  bool receive_view(F &&func) {
+    ASSERT(mode_ == Mode::DIRECT);
+    std::lock_guard<std::mutex> guard(recv_mtx);
+    if(ring.empty()) {
+      fill_ring();
     }
+    if(ring.empty()) {
+      return false;
+    }
+    BlobView view = ring.front();
+    count_received(view, true);
+    ring.pop();
+    func(view);
+    return true;
+  }
 
-    blob.resize(received_bytes);
-    blob.addr = Addr(saddr_from);
+  // same for a single channel, only one thread may receive from a channel.
+  // datagrams of other channels wait in their own inbox
+  template <typename F>
+  bool receive_view(channel_t channel, F &&func) {
+    if(channel == ANY_CHANNEL) {
+      return receive_view(std::forward<F>(func));
+    }
+    ASSERT(channel < NO_CHANNELS);
+    Inbox &inbox = inboxes[channel];
+    const Datagram<MAX_PACKET_SIZE> *dgram = inbox.queue.front();
+    if(dgram != nullptr) {
+      func(dgram->view());
+      inbox.queue.pop();
+      return true;
+    }
+    if(mode_ == Mode::IO_THREAD) {
+      return false;
+    }
+    std::lock_guard<std::mutex> guard(recv_mtx);
+    while(1) {
+      if(ring.empty()) {
+        fill_ring();
+      }
+      if(ring.empty()) {
+        return false;
+      }
+      BlobView view = ring.front();
+      std::optional<channel_t> route = route_of(view);
+      count_received(view, route.has_value());
+      if(route == channel) {
+        func(view);
+        ring.pop();
+        return true;
+      } else if(route.has_value()) {
+        stash(route.value(), view);
+        notify(inboxes[route.value()].event);
+      }
+      ring.pop();
+    }
+  }
 
-    return blob;
+  std::optional<Blob> receive(channel_t channel=ANY_CHANNEL) {
+    std::optional<Blob> opt_blob;
+    receive_view(channel, [&](const BlobView &view) mutable {
+      opt_blob = Blob(view);
+    });
+    return opt_blob;
   }
 
   constexpr port_t port() const {
     return port_;
   }
 
-  template <typename G, typename F>
-  void listen(G &&break_func, F &&idle) {
-    std::optional<Blob> opt_blob;
+  // appends every datagram the socket receives or sends from now on to a trace
+  // file, replacing any earlier capture
+  bool capture(const std::string &filename) {
+    auto trace = std::make_shared<TraceWriter>();
+    if(!trace->open(filename)) {
+      Logger::Warning("socket: can't open trace file %s\n", filename.c_str());
+      return false;
+    }
+    std::atomic_store(&trace_, trace);
+    return true;
+  }
+
+  void stop_capture() {
+    std::atomic_store(&trace_, std::shared_ptr<TraceWriter>());
+  }
+
+  // datagrams of the channel from anyone but peers are dropped by the demux
+  void accept_from(channel_t channel, const std::set<Addr> &peers) {
+    ASSERT(channel < NO_CHANNELS);
+    std::atomic_store(&inboxes[channel].peers, std::make_shared<const std::set<Addr>>(peers));
+  }
+
+  void accept_all(channel_t channel) {
+    ASSERT(channel < NO_CHANNELS);
+    std::atomic_store(&inboxes[channel].peers, std::shared_ptr<const std::set<Addr>>());
+  }
+
+  // stamps the session a server at addr gave out on the channel into
+  // everything sent there, NO_SESSION stops it
+  void set_session(const Addr &addr, channel_t channel, session_t session) {
+    ASSERT(channel < NO_CHANNELS);
+    std::lock_guard<std::mutex> guard(session_mtx);
+    auto sessions = std::atomic_load(&sessions_);
+    SessionMap updated = (sessions != nullptr) ? *sessions : SessionMap();
+    if(session == NO_SESSION) {
+      updated.erase({addr, channel});
+    } else {
+      updated[{addr, channel}] = session;
+    }
+    std::atomic_store(&sessions_, updated.empty() ? nullptr : std::make_shared<const SessionMap>(std::move(updated)));
+  }
+
+  session_t session_of(const Addr &addr, channel_t channel) const {
+    return session_of(std::atomic_load(&sessions_), addr, channel);
+  }
+
+  // datagrams the channel's inbox had no room for
+  size_t dropped(channel_t channel) const {
+    ASSERT(channel < NO_CHANNELS);
+    return inboxes[channel].dropped;
+  }
+
+  Metrics &metrics() {
+    return metrics_;
+  }
+
+  // one json object per line with the traffic so far and the current depth
+  // of the socket's queues
+  void write_metrics(FILE *file) {
+    fprintf(file, "{\"time\":%.6f,\"port\":%hu,\"inboxes\":[", Timer::system_time(), port_);
+    for(channel_t c = 0; c < NO_CHANNELS; ++c) {
+      fprintf(file, "%s{\"depth\":%lu,\"dropped\":%lu}", (c == 0) ? "" : ",",
+        inboxes[c].queue.size(), inboxes[c].dropped.load());
+    }
+    fprintf(file, "],\"outbox\":%lu,", (mode_ == Mode::IO_THREAD) ? std::min(outbox->size(), OUTBOX_SIZE) : 0);
+    fprintf(file, "\"backlog\":{\"depth\":%lu,\"replaced\":%lu,\"dropped\":%lu},",
+      backlog_size.load(), backlog_replaced.load(), backlog_dropped.load());
+    metrics_.write_json(file);
+    fprintf(file, "}\n");
+    fflush(file);
+  }
+
+  // datagrams waiting for the socket to become writable
+  size_t backlog_depth() const {
+    return backlog_size;
+  }
+
+  // interrupts threads sleeping in wait()
+  void wakeup() {
+    notify(event_);
+    for(channel_t c = 0; c < NO_CHANNELS; ++c) {
+      notify(inboxes[c].event);
+    }
+  }
+
+  // sleeps until the socket becomes readable, wakeup() is called or the timeout
+  // runs out
+  void wait(Timer::time_t timeout=MAX_WAIT) {
+    timeout = std::fmin(std::fmax(timeout, .0), MAX_WAIT);
+    epoll_event events[2];
+    int no_events = epoll_wait(epoll_, events, 2, int(std::ceil(timeout * 1e3)));
+    for(int i = 0; i < no_events; ++i) {
+      if(events[i].data.fd == event_) {
+        consume(event_);
+      } else if((events[i].events & EPOLLOUT) && mode_ == Mode::DIRECT) {
+        std::lock_guard<std::mutex> guard(send_mtx);
+        retry_backlog();
+      }
+    }
+  }
+
+  // also wakes up when another thread stashes a datagram in the channel's
+  // inbox. in i/o thread mode only the inbox is waited for
+  void wait(channel_t channel, Timer::time_t timeout) {
+    if(channel == ANY_CHANNEL) {
+      wait(timeout);
+      return;
+    }
+    timeout = std::fmin(std::fmax(timeout, .0), MAX_WAIT);
+    const short writable = (backlog_size > 0) ? POLLOUT : 0;
+    pollfd pfds[] = {
+      { .fd = inboxes[channel].event, .events = POLLIN, .revents = 0 },
+      { .fd = event_, .events = POLLIN, .revents = 0 },
+      { .fd = handle_, .events = short(POLLIN | writable), .revents = 0 },
+    };
+    const nfds_t no_fds = (mode_ == Mode::IO_THREAD) ? 1 : 3;
+    if(poll(pfds, no_fds, int(std::ceil(timeout * 1e3))) > 0) {
+      for(nfds_t i = 0; i < 2 && i < no_fds; ++i) {
+        if(pfds[i].revents & POLLIN) {
+          consume(pfds[i].fd);
+        }
+      }
+      if(no_fds == 3 && (pfds[2].revents & POLLOUT)) {
+        std::lock_guard<std::mutex> guard(send_mtx);
+        retry_backlog();
+      }
+    }
+  }
+
+  // for event loops which serve many sockets from one thread: the descriptors
+  // which become readable when a datagram of the channel may be waiting
+  std::vector<int> descriptors(channel_t channel) const {
+    if(channel == ANY_CHANNEL) {
+      ASSERT(mode_ == Mode::DIRECT);
+      return {handle_};
+    }
+    ASSERT(channel < NO_CHANNELS);
+    if(mode_ == Mode::IO_THREAD) {
+      return {inboxes[channel].event};
+    }
+    return {inboxes[channel].event, handle_};
+  }
+
+  // the descriptors which become writable when the backlog may be sent, none
+  // in i/o thread mode
+  std::vector<int> writable_descriptors() const {
+    if(mode_ == Mode::IO_THREAD) {
+      return {};
+    }
+    return {handle_};
+  }
+
+  // consumes the wakeups of the channel's descriptors and tells whether a
+  // datagram is already waiting where they won't signal it. a loop should
+  // only sleep on descriptors() if this is false
+  bool settle(channel_t channel) {
+    bool pending = false;
+    if(channel != ANY_CHANNEL) {
+      ASSERT(channel < NO_CHANNELS);
+      consume(inboxes[channel].event);
+      pending = inboxes[channel].queue.front() != nullptr;
+    }
+    if(!pending && mode_ == Mode::DIRECT) {
+      std::lock_guard<std::mutex> guard(recv_mtx);
+      pending = !ring.empty();
+    }
+    return pending;
+  }
+
+  // break_func runs once per tick, a tick handles up to BATCH_SIZE messages
+  // which are already there
+  template <typename W, typename G, typename F>
+  void listen_wait(channel_t channel, W &&wait_time, G &&break_func, F &&idle) {
     bool cond = 1;
     while(cond) {
       if(!break_func()) {
         break;
       }
-      if((opt_blob = receive()).has_value()) {
-        cond = idle(*opt_blob);
+      int no_received = 0;
+      for(; cond && no_received < BATCH_SIZE; ++no_received) {
+        bool received = receive_view(channel, [&](const BlobView &view) mutable {
+          cond = idle(view);
+        });
+        if(!received) {
+          break;
+        }
+      }
+      if(no_received == 0) {
+        wait(channel, wait_time());
       }
     }
   }
 
+  // break_func is expected to service the timer, so sleep no longer than until
+  // its next timeout is due
+  template <typename G, typename F>
+  void listen(channel_t channel, const Timer &timer, G &&break_func, F &&idle) {
+    listen_wait(channel,
+      [&]() {
+        Timer::time_t left = timer.time_left();
+        // an expired timeout which break_func did not reset is not serviced
+        return (left > .0) ? left : MAX_WAIT;
+      },
+      std::forward<G>(break_func),
+      std::forward<F>(idle)
+    );
+  }
+
+  template <typename G, typename F>
+  void listen(const Timer &timer, G &&break_func, F &&idle) {
+    listen(ANY_CHANNEL, timer, std::forward<G>(break_func), std::forward<F>(idle));
+  }
+
+  template <typename G, typename F>
+  void listen(channel_t channel, G &&break_func, F &&idle) {
+    listen_wait(channel, [](){return MAX_WAIT;}, std::forward<G>(break_func), std::forward<F>(idle));
+  }
+
+  template <typename G, typename F>
+  void listen(G &&break_func, F &&idle) {
+    listen(ANY_CHANNEL, std::forward<G>(break_func), std::forward<F>(idle));
+  }
+
   template <typename F>
   void listen(F &&idle) {
     listen([](){return true;}, std::forward<F>(idle));
   }
+
+private:
+  static session_t session_of(const std::shared_ptr<const SessionMap> &sessions, const Addr &addr, channel_t channel) {
+    if(sessions == nullptr) {
+      return NO_SESSION;
+    }
+    auto it = sessions->find({addr, channel});
+    return (it != std::end(*sessions)) ? it->second : NO_SESSION;
+  }
+
+  static void notify(int fd) {
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof(one)) != sizeof(one)) {
+      perror("error");
+    }
+  }
+
+  static void consume(int fd) {
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+      errno = 0;
+    }
+  }
+
+  // returns the number of bytes sent, -1 on error
+  ssize_t send_to(const Addr &addr, const void *data, size_t len) {
+    sockaddr_in address = addr;
+    iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    mmsghdr msg;
+    memset(&msg, 0, sizeof(mmsghdr));
+    msg.msg_hdr.msg_name = &address;
+    msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+    if(transmit(&msg, 1) != 1) {
+      return -1;
+    }
+    return msg.msg_len;
+  }
+
+  int fill_ring() {
+    return ring.fill([&](mmsghdr *msgs, unsigned no_msgs) mutable {
+      int received = transport_.receive(handle_, msgs, no_msgs);
+      for(int i = 0; i < received; ++i) {
+        Addr addr(*(const sockaddr_in *)msgs[i].msg_hdr.msg_name);
+        metrics_.received_datagram(addr.ip, addr.port, msgs[i].msg_len);
+        // truncated datagrams are dropped by the ring
+        if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+          metrics_.dropped_datagram(addr.ip, addr.port);
+        }
+      }
+      record(TraceDirection::RECEIVED, msgs, received);
+      return received;
+    });
+  }
+
+  // like sendmmsg: on error the first datagram could not be sent
+  int transmit(mmsghdr *msgs, unsigned no_msgs) {
+    int sent = transport_.send(handle_, msgs, no_msgs);
+    if(sent < 0 && !would_block()) {
+      Addr addr(*(const sockaddr_in *)msgs[0].msg_hdr.msg_name);
+      metrics_.send_failed_datagram(addr.ip, addr.port);
+    }
+    for(int i = 0; i < sent; ++i) {
+      Addr addr(*(const sockaddr_in *)msgs[i].msg_hdr.msg_name);
+      if(msgs[i].msg_len < msgs[i].msg_hdr.msg_iov[0].iov_len) {
+        metrics_.send_failed_datagram(addr.ip, addr.port);
+      } else {
+        metrics_.sent_datagram(addr.ip, addr.port, msgs[i].msg_len);
+      }
+    }
+    record(TraceDirection::SENT, msgs, sent);
+    return sent;
+  }
+
+  // datagrams are recorded as they are on the wire, bundles included
+  void record(TraceDirection direction, const mmsghdr *msgs, int no_msgs) {
+    if(no_msgs <= 0) {
+      return;
+    }
+    auto trace = std::atomic_load(&trace_);
+    if(!trace) {
+      return;
+    }
+    for(int i = 0; i < no_msgs; ++i) {
+      const msghdr &hdr = msgs[i].msg_hdr;
+      Addr addr(*(const sockaddr_in *)hdr.msg_name);
+      trace->write(direction, addr.ip, addr.port, hdr.msg_iov[0].iov_base, msgs[i].msg_len);
+    }
+  }
+
+  // sends a datagram which is ready for the wire, used for bundles
+  void send_datagram(const Addr &addr, const void *data, size_t len, const Drop &drop) {
+    if(mode_ == Mode::IO_THREAD) {
+      if(!enqueue(addr, data, len, drop)) {
+        Logger::Warning("socket: outbox full, dropped datagram to %s\n", addr.to_str().c_str());
+        metrics_.dropped_datagram(addr.ip, addr.port);
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> guard(send_mtx);
+    send_or_defer(addr, data, len, drop);
+  }
+
+  bool enqueue(const Addr &addr, const void *bytes, size_t len, const Drop &drop) {
+    return outbox->push_with([&](SendQueue::Entry &entry) mutable {
+      entry.dgram.assign(addr, bytes, len);
+      entry.drop = drop;
+    });
+  }
+
+  // guarded by send_mtx. the datagram goes out now unless others are waiting
+  // or the socket would block, in which case it waits too. false if it was
+  // dropped or failed
+  bool send_or_defer(const Addr &addr, const void *data, size_t len, const Drop &drop) {
+    retry_backlog();
+    if(!backlog.empty()) {
+      return defer(addr, data, len, drop);
+    }
+    if(send_to(addr, data, len) == ssize_t(len)) {
+      return true;
+    }
+    if(would_block()) {
+      errno = 0;
+      return defer(addr, data, len, drop);
+    }
+    Logger::Warning("socket: failed to send to %s\n", addr.to_str().c_str());
+    metrics_.send_failed_message(*(const msgid_t *)data);
+    errno = 0;
+    return false;
+  }
+
+  // guarded by send_mtx
+  bool defer(const Addr &addr, const void *data, size_t len, const Drop &drop) {
+    switch(backlog.push(addr, data, len, drop)) {
+      case SendQueue::Result::QUEUED:
+      break;
+      case SendQueue::Result::REPLACED:
+        ++backlog_replaced;
+      break;
+      case SendQueue::Result::DROPPED:
+        ++backlog_dropped;
+        metrics_.dropped_message(*(const msgid_t *)data);
+        metrics_.dropped_datagram(addr.ip, addr.port);
+        if(!drop.droppable) {
+          Logger::Warning("socket: send queue full, dropped datagram to %s\n", addr.to_str().c_str());
+        }
+        return false;
+    }
+    watch_backlog();
+    return true;
+  }
+
+  // guarded by send_mtx
+  void retry_backlog() {
+    if(backlog.empty()) {
+      return;
+    }
+    backlog.send(
+      [&](mmsghdr *msgs, unsigned no_msgs) mutable {
+        return transmit(msgs, no_msgs);
+      },
+      [&](const SendQueue::Entry &entry) mutable {
+        Logger::Warning("socket: failed to send to %s\n", entry.dgram.addr.to_str().c_str());
+        metrics_.send_failed_message(entry.dgram.data[0]);
+      });
+    watch_backlog();
+  }
+
+  // guarded by send_mtx. wait() also wakes up for the socket becoming writable
+  // while datagrams are waiting for it
+  void watch_backlog() {
+    backlog_size = backlog.size();
+    const bool watch = !backlog.empty();
+    if(watch == watching_writable) {
+      return;
+    }
+    epoll_event ev;
+    ev.events = uint32_t(EPOLLIN) | (watch ? uint32_t(EPOLLOUT) : 0u);
+    ev.data.fd = handle_;
+    if(epoll_ctl(epoll_, EPOLL_CTL_MOD, handle_, &ev) == -1) {
+      perror("error");
+      errno = 0;
+      return;
+    }
+    watching_writable = watch;
+  }
+
+  // i/o thread: sends everything queued in the outbox, BATCH_SIZE datagrams per
+  // sendmmsg call
+  void flush_outbox() {
+    sockaddr_in addrs[BATCH_SIZE];
+    iovec iovs[BATCH_SIZE];
+    mmsghdr msgs[BATCH_SIZE];
+    std::lock_guard<std::mutex> guard(send_mtx);
+    retry_backlog();
+    while(1) {
+      int no_msgs = 0;
+      SendQueue::Entry *entry;
+      while(no_msgs < BATCH_SIZE && (entry = outbox->front()) != nullptr) {
+        send_batch[no_msgs] = *entry;
+        outbox->pop();
+        ++no_msgs;
+      }
+      if(no_msgs == 0) {
+        transport_.submit(handle_);
+        return;
+      }
+      // the outbox is drained into the backlog while the socket is full, so
+      // that its drop policies apply
+      if(!backlog.empty()) {
+        for(int i = 0; i < no_msgs; ++i) {
+          defer(send_batch[i].dgram.addr, send_batch[i].dgram.data, send_batch[i].dgram.size, send_batch[i].drop);
+        }
+        continue;
+      }
+      for(int i = 0; i < no_msgs; ++i) {
+        const Datagram<> &dgram = send_batch[i].dgram;
+        addrs[i] = dgram.addr;
+        iovs[i].iov_base = (void *)dgram.data;
+        iovs[i].iov_len = dgram.size;
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      int i = 0;
+      while(i < no_msgs) {
+        int sent = transmit(&msgs[i], no_msgs - i);
+        if(sent < 0 && would_block()) {
+          errno = 0;
+          for(; i < no_msgs; ++i) {
+            defer(send_batch[i].dgram.addr, send_batch[i].dgram.data, send_batch[i].dgram.size, send_batch[i].drop);
+          }
+          break;
+        } else if(sent < 0) {
+          Logger::Warning("socket: failed to send to %s\n", send_batch[i].dgram.addr.to_str().c_str());
+          errno = 0;
+          ++i;
+          continue;
+        }
+        i += sent;
+      }
+    }
+  }
+
+  // the channel a datagram is routed to, nothing for unknown channels and
+  // senders the channel does not accept
+  std::optional<channel_t> route_of(const BlobView &view) const {
+    auto hdr = view.header();
+    if(!hdr.has_value() || channel_of(hdr->id) >= NO_CHANNELS) {
+      return std::nullopt;
+    }
+    channel_t channel = channel_of(hdr->id);
+    auto peers = std::atomic_load(&inboxes[channel].peers);
+    if(peers && peers->find(view.addr) == std::end(*peers)) {
+      return std::nullopt;
+    }
+    return channel;
+  }
+
+  void stash(channel_t channel, const BlobView &view) {
+    Inbox &inbox = inboxes[channel];
+    bool queued = view.size() <= MAX_PACKET_SIZE && inbox.queue.push_with([&](Datagram<MAX_PACKET_SIZE> &dgram) mutable {
+      dgram.assign(view.addr, view.data(), view.size(), view.arrival);
+    });
+    if(!queued) {
+      ++inbox.dropped;
+      metrics_.dropped_message(view.header()->id);
+      metrics_.dropped_datagram(view.addr.ip, view.addr.port);
+    }
+  }
+
+  // per message, those which are not routed anywhere count as dropped
+  void count_received(const BlobView &view, bool routed) {
+    auto hdr = view.header();
+    msgid_t id = hdr.has_value() ? hdr->id : 0;
+    metrics_.received_message(id, view.size());
+    if(!routed) {
+      metrics_.dropped_message(id);
+      metrics_.dropped_datagram(view.addr.ip, view.addr.port);
+    }
+  }
+
+  // i/o thread: moves received datagrams into the inboxes of their channels
+  void drain_socket() {
+    bool touched[NO_CHANNELS] = {false};
+    while(fill_ring() > 0) {
+      for(; !ring.empty(); ring.pop()) {
+        BlobView view = ring.front();
+        std::optional<channel_t> route = route_of(view);
+        count_received(view, route.has_value());
+        if(route.has_value()) {
+          stash(route.value(), view);
+          touched[route.value()] = true;
+        }
+      }
+    }
+    for(channel_t c = 0; c < NO_CHANNELS; ++c) {
+      if(touched[c]) {
+        notify(inboxes[c].event);
+      }
+    }
+  }
+
+  void run_io() {
+    while(!io_stop) {
+      flush_outbox();
+      drain_socket();
+      wait();
+    }
+    flush_outbox();
+  }
 };
 
 /* template <> */
@@ -620,7 +2202,7 @@ namespace Typecheck {
       static constexpr bool value = all_true<distinct<T, Ts>::value...> && distinct<Ts...>::value;
     };
     template <typename Ta, typename Tb> struct distinct<Ta, Tb> {
-      static constexpr bool value = sizeof(Ta) != sizeof(Tb);
+      static constexpr bool value = Message<Ta>::id != Message<Tb>::id;
     };
     template <typename T> struct distinct<T> {
       static constexpr bool value = true;
@@ -632,4 +2214,40 @@ namespace Typecheck {
   template <typename... Ts> constexpr bool all_distinct = detail::distinct<Ts...>::value;
 }
 
+
+// set of messages a handler understands. dispatch looks the message id up in
+// a table generated at compile time and calls the handler at the same
+// position as the message type, so every packet is visited at most once
+template <typename... Ts>
+struct Protocol {
+  static_assert(Typecheck::all_distinct<Ts...>, "message ids must be unique");
+
+  template <typename B, typename... Fs>
+  static bool dispatch(const B &blob, Fs &&...funcs) {
+    static_assert(sizeof...(Ts) == sizeof...(Fs), "one handler per message type");
+    using handlers_t = std::tuple<Fs &...>;
+    static constexpr auto table = make_table<B, handlers_t>(std::index_sequence_for<Ts...>());
+    auto hdr = blob.header();
+    if(!hdr.has_value() || table[hdr->id] == nullptr) {
+      return false;
+    }
+    handlers_t handlers(funcs...);
+    return table[hdr->id](blob, handlers);
+  }
+
+private:
+  template <size_t I, typename B, typename H>
+  static bool visit(const B &blob, H &handlers) {
+    using T = std::tuple_element_t<I, std::tuple<Ts...>>;
+    return blob.template try_visit_as<T>(std::get<I>(handlers));
+  }
+
+  template <typename B, typename H, size_t... Is>
+  static constexpr auto make_table(std::index_sequence<Is...>) {
+    std::array<bool (*)(const B &, H &), 1 << (8 * sizeof(msgid_t))> table{};
+    ((table[Message<std::tuple_element_t<Is, std::tuple<Ts...>>>::id] = &visit<Is, B, H>), ...);
+    return table;
+  }
+};
+
 }
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+#include <type_traits>
+
+// bounded lock-free queues. capacities have to be powers of two
+
+// any number of producers, a single consumer. cells carry a sequence number
+// telling whether they are free to write (seq == pos) or ready to read
+// (seq == pos + 1). a cell which was claimed and never published, because its
+// producer died in between, can be skipped by the consumer
+template <typename T, size_t N>
+class MPSCQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  Cell cells[N];
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) size_t head = 0;
+public:
+  MPSCQueue():
+    tail(0)
+  {
+    for(size_t i = 0; i < N; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // returns false if the queue is full, or if the cell was skipped before it
+  // was published
+  template <typename F>
+  bool push_with(F &&func) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    while(1) {
+      cell = &cells[pos & (N - 1)];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos);
+      if(diff == 0) {
+        if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    func(cell->data);
+    size_t claimed = pos;
+    return cell->seq.compare_exchange_strong(claimed, pos + 1, std::memory_order_release, std::memory_order_relaxed);
+  }
+
+  bool push(const T &value) {
+    return push_with([&](T &data) mutable {
+      data = value;
+    });
+  }
+
+  // consumer only
+  T *front() {
+    Cell &cell = cells[head & (N - 1)];
+    size_t seq = cell.seq.load(std::memory_order_acquire);
+    if(seq != head + 1) {
+      return nullptr;
+    }
+    return &cell.data;
+  }
+
+  // consumer only, after front() returned an element
+  void pop() {
+    Cell &cell = cells[head & (N - 1)];
+    cell.seq.store(head + N, std::memory_order_release);
+    ++head;
+  }
+
+  // consumer only. whether the head cell is claimed but not published yet
+  bool claimed() const {
+    const Cell &cell = cells[head & (N - 1)];
+    return tail.load(std::memory_order_acquire) != head && cell.seq.load(std::memory_order_acquire) == head;
+  }
+
+  // consumer only. frees the head cell if it is still claimed, its producer
+  // fails to publish it then
+  bool skip() {
+    Cell &cell = cells[head & (N - 1)];
+    size_t expected = head;
+    if(tail.load(std::memory_order_acquire) == head || !cell.seq.compare_exchange_strong(expected, head + N, std::memory_order_acq_rel)) {
+      return false;
+    }
+    ++head;
+    return true;
+  }
+
+  size_t size() const {
+    return tail.load(std::memory_order_relaxed) - head;
+  }
+};
+
+// a single producer and a single consumer
+template <typename T, size_t N>
+class SPSCQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+  T cells[N];
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<size_t> head;
+public:
+  SPSCQueue():
+    tail(0), head(0)
+  {}
+
+  // producer only. returns false if the queue is full
+  template <typename F>
+  bool push_with(F &&func) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    if(pos - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    func(cells[pos & (N - 1)]);
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool push(const T &value) {
+    return push_with([&](T &data) mutable {
+      data = value;
+    });
+  }
+
+  // consumer only. the element stays valid until pop()
+  T *front() {
+    size_t pos = head.load(std::memory_order_relaxed);
+    if(pos == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &cells[pos & (N - 1)];
+  }
+
+  // consumer only, after front() returned an element
+  void pop() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+};
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <map>
+#include <limits>
+#include <optional>
+
+#include "Network.hpp"
+#include "Timer.hpp"
+#include "Optimizations.hpp"
+
+namespace net {
+
+typedef uint16_t seq_t;
+
+// sequence numbers wrap around; a is ahead of b by distance(b, a)
+constexpr seq_t seq_distance(seq_t from, seq_t to) {
+  return seq_t(to - from);
+}
+
+constexpr bool seq_before(seq_t a, seq_t b) {
+  return a != b && seq_distance(a, b) < 0x8000;
+}
+
+// everything before next has arrived, bit i of bits tells whether
+// next + 1 + i has arrived as well
+struct Ack {
+  seq_t next = 0;
+  uint32_t bits = 0;
+
+  static constexpr seq_t WINDOW = 32;
+
+  constexpr bool acknowledges(seq_t seq) const {
+    if(seq_before(seq, next)) {
+      return true;
+    }
+    seq_t dist = seq_distance(next, seq);
+    return dist >= 1 && dist <= WINDOW && (bits & (uint32_t(1) << (dist - 1)));
+  }
+} ATTRIB_PACKED;
+
+template <>
+struct Fields<Ack> {
+  using S = Ack;
+  using type = FieldList<
+    Field<&S::next, Bits<16>>,
+    Field<&S::bits, Bits<32>>
+  >;
+};
+
+// which of the latest sequence numbers arrived, for messages which are not
+// retransmitted. bit i of bits tells whether latest - 1 - i has arrived
+struct ReceiveWindow {
+  seq_t latest = 0;
+  uint32_t bits = 0;
+  bool any = false;
+
+  static constexpr seq_t WINDOW = 32;
+
+  void mark(seq_t seq) {
+    if(!any) {
+      latest = seq, bits = 0, any = true;
+    } else if(seq_before(latest, seq)) {
+      seq_t dist = seq_distance(latest, seq);
+      if(dist > WINDOW) {
+        bits = 0;
+      } else {
+        bits = (dist < WINDOW) ? bits << dist : 0;
+        bits |= uint32_t(1) << (dist - 1);
+      }
+      latest = seq;
+    } else {
+      seq_t dist = seq_distance(seq, latest);
+      if(dist >= 1 && dist <= WINDOW) {
+        bits |= uint32_t(1) << (dist - 1);
+      }
+    }
+  }
+
+  constexpr bool contains(seq_t seq) const {
+    if(!any) {
+      return false;
+    }
+    seq_t dist = seq_distance(seq, latest);
+    return dist == 0 || (dist <= WINDOW && (bits & (uint32_t(1) << (dist - 1))));
+  }
+} ATTRIB_PACKED;
+
+template <>
+struct Fields<ReceiveWindow> {
+  using S = ReceiveWindow;
+  using type = FieldList<
+    Field<&S::latest, Bits<16>>,
+    Field<&S::bits, Bits<32>>,
+    Field<&S::any, Bits<1>>
+  >;
+};
+
+template <typename T>
+struct Reliable {
+  seq_t seq;
+  T data;
+} ATTRIB_PACKED;
+
+template <typename T>
+struct Fields<Reliable<T>> {
+  using S = Reliable<T>;
+  using type = FieldList<
+    Field<&S::seq, Bits<16>>,
+    Field<&S::data, Nested>
+  >;
+};
+
+// how far the sender may run ahead of what was acknowledged. the receiver
+// drops anything further ahead of a gap
+constexpr seq_t RELIABLE_WINDOW = 256;
+
+// keeps messages until they are acknowledged and sends them again once the
+// retransmission timeout runs out. the timeout follows the measured round
+// trip time as in rfc 6298, samples of retransmitted messages are ignored.
+// at most RELIABLE_WINDOW messages are in flight
+template <typename T>
+class ReliableSender {
+  struct Pending {
+    T data;
+    Timer::time_t sent;
+    int attempts;
+  };
+
+  static constexpr Timer::time_t INITIAL_RTO = .2;
+  static constexpr Timer::time_t MIN_RTO = .03;
+  static constexpr Timer::time_t MAX_RTO = 1.;
+
+  seq_t next_seq = 0;
+  std::map<seq_t, Pending> in_flight;
+  Timer::time_t srtt_ = -1.;
+  Timer::time_t rttvar = .0;
+  Timer::time_t rto_ = INITIAL_RTO;
+
+  Timer::time_t timeout(const Pending &p) const {
+    return std::fmin(rto_ * (1 << std::min(p.attempts - 1, 5)), MAX_RTO);
+  }
+
+  void sample_rtt(Timer::time_t rtt) {
+    if(srtt_ < .0) {
+      srtt_ = rtt;
+      rttvar = rtt / 2;
+    } else {
+      rttvar = .75 * rttvar + .25 * std::fabs(srtt_ - rtt);
+      srtt_ = .875 * srtt_ + .125 * rtt;
+    }
+    rto_ = std::fmax(MIN_RTO, std::fmin(srtt_ + 4 * rttvar, MAX_RTO));
+  }
+public:
+  ReliableSender()
+  {}
+
+  // registers a message and returns the packet to send, nothing if the
+  // window is full. the peer then has not acknowledged anything for long
+  std::optional<Reliable<T>> push(const T &data, Timer::time_t now) {
+    if(full()) {
+      return std::nullopt;
+    }
+    seq_t seq = next_seq++;
+    in_flight[seq] = (Pending){ .data = data, .sent = now, .attempts = 1 };
+    return (Reliable<T>){ .seq = seq, .data = data };
+  }
+
+  void acknowledge(const Ack &ack, Timer::time_t now) {
+    acknowledge(ack, now, [](Timer::time_t) {});
+  }
+
+  // on_sample(rtt) is called for every round trip time measured
+  template <typename F>
+  void acknowledge(const Ack &ack, Timer::time_t now, F &&on_sample) {
+    for(auto it = in_flight.begin(); it != in_flight.end();) {
+      if(ack.acknowledges(it->first)) {
+        if(it->second.attempts == 1) {
+          sample_rtt(now - it->second.sent);
+          on_sample(now - it->second.sent);
+        }
+        it = in_flight.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // send_func(packet) is called for every message whose timeout ran out
+  template <typename F>
+  void retransmit(Timer::time_t now, F &&send_func) {
+    for(auto &[seq, p] : in_flight) {
+      if(now - p.sent >= timeout(p)) {
+        p.sent = now;
+        ++p.attempts;
+        send_func((Reliable<T>){ .seq = seq, .data = p.data });
+      }
+    }
+  }
+
+  // time until the next retransmission is due, infinity if nothing is in flight
+  Timer::time_t time_left(Timer::time_t now) const {
+    Timer::time_t left = std::numeric_limits<Timer::time_t>::infinity();
+    for(const auto &[seq, p] : in_flight) {
+      left = std::fmin(left, p.sent + timeout(p) - now);
+    }
+    return std::fmax(left, .0);
+  }
+
+  size_t size() const {
+    return in_flight.size();
+  }
+
+  bool full() const {
+    return in_flight.size() >= RELIABLE_WINDOW;
+  }
+
+  Timer::time_t rtt() const {
+    return srtt_;
+  }
+
+  Timer::time_t rto() const {
+    return rto_;
+  }
+};
+
+// delivers every message exactly once and in order. messages which arrive
+// ahead of a gap are held back until it is filled
+template <typename T>
+class ReliableReceiver {
+  // how far ahead of a gap messages are buffered
+  static constexpr seq_t MAX_AHEAD = RELIABLE_WINDOW;
+
+  seq_t next = 0;
+  std::map<seq_t, T> ahead;
+public:
+  ReliableReceiver()
+  {}
+
+  // returns the number of messages passed to deliver
+  template <typename F>
+  int receive(const Reliable<T> &packet, F &&deliver) {
+    seq_t dist = seq_distance(next, packet.seq);
+    if(dist >= 0x8000 || dist > MAX_AHEAD) {
+      // duplicate of a delivered message or too far ahead
+      return 0;
+    }
+    if(dist > 0) {
+      ahead.insert({packet.seq, packet.data});
+      return 0;
+    }
+    int delivered = 0;
+    deliver(packet.data);
+    ++next, ++delivered;
+    for(auto it = ahead.find(next); it != ahead.end(); it = ahead.find(next)) {
+      deliver(it->second);
+      ahead.erase(it);
+      ++next, ++delivered;
+    }
+    return delivered;
+  }
+
+  Ack ack() const {
+    Ack a;
+    a.next = next;
+    a.bits = 0;
+    for(const auto &[seq, data] : ahead) {
+      seq_t dist = seq_distance(next, seq);
+      if(dist >= 1 && dist <= Ack::WINDOW) {
+        a.bits |= uint32_t(1) << (dist - 1);
+      }
+    }
+    return a;
+  }
+};
+
+}
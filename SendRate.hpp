@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <algorithm>
+#include <limits>
+
+#include "Timer.hpp"
+#include "Reliable.hpp"
+#include "Metrics.hpp"
+
+namespace net {
+
+// rate of a stream of messages which are not retransmitted, like snapshots,
+// from what the receiver acknowledges with a ReceiveWindow. once per round
+// trip the rate grows by a step, or is cut if messages were lost or the round
+// trip grew past the shortest one seen by a queueing delay, as tcp does with
+// its window. lost messages, round trips and delivered bytes are smoothed into
+// estimates of the path, reported through estimate()
+class SendRate {
+public:
+  // messages per second
+  static constexpr double MIN_RATE = 5.;
+  static constexpr double MAX_RATE = 60.;
+  static constexpr double INITIAL_RATE = 10.;
+  static constexpr double RATE_STEP = 5.;
+  static constexpr double DECREASE = .7;
+  // a round trip this much longer than the shortest is taken for a queue
+  static constexpr Timer::time_t QUEUE_DELAY = .05;
+  // a message is lost once this many later ones were acknowledged
+  static constexpr seq_t REORDERING = 3;
+  // round trips and intervals without acknowledgements until the rate is cut
+  static constexpr double SILENCE = 4.;
+private:
+  static constexpr size_t HISTORY = 64;
+  static constexpr double GAIN = .125;
+  static constexpr Timer::time_t INITIAL_RTT = .1;
+
+  struct Sent {
+    seq_t seq = 0;
+    bool pending = false;
+    Timer::time_t time = .0;
+    size_t bytes = 0;
+  };
+
+  Sent sent_[HISTORY];
+  double rate_ = INITIAL_RATE;
+  Timer::time_t srtt_ = -1.;
+  Timer::time_t min_rtt_ = std::numeric_limits<Timer::time_t>::infinity();
+  double loss_ = .0;
+  double bandwidth_ = .0;
+  // since the rate was last changed, or the first message was sent
+  bool started = false;
+  Timer::time_t period_start = .0;
+  size_t no_acked = 0, no_lost = 0, bytes_acked = 0;
+  Timer::time_t max_rtt = .0;
+
+  void sample_rtt(Timer::time_t rtt) {
+    srtt_ = (srtt_ < .0) ? rtt : (1 - GAIN) * srtt_ + GAIN * rtt;
+    min_rtt_ = std::fmin(min_rtt_, rtt);
+    max_rtt = std::fmax(max_rtt, rtt);
+  }
+
+  void adjust(Timer::time_t now) {
+    const Timer::time_t period = now - period_start;
+    if(period < rtt()) {
+      return;
+    }
+    if(no_acked + no_lost > 0) {
+      loss_ = (1 - GAIN) * loss_ + GAIN * double(no_lost) / (no_acked + no_lost);
+    }
+    bandwidth_ = (1 - GAIN) * bandwidth_ + GAIN * bytes_acked / period;
+    if(no_lost > 0 || max_rtt > min_rtt_ + QUEUE_DELAY) {
+      rate_ *= DECREASE;
+    } else if(no_acked > 0) {
+      rate_ += RATE_STEP;
+    }
+    rate_ = std::fmax(MIN_RATE, std::fmin(rate_, MAX_RATE));
+    period_start = now;
+    no_acked = no_lost = bytes_acked = 0;
+    max_rtt = .0;
+  }
+public:
+  SendRate()
+  {}
+
+  void sent(seq_t seq, size_t bytes, Timer::time_t now) {
+    if(!started) {
+      started = true;
+      period_start = now;
+    }
+    sent_[seq % HISTORY] = (Sent){ .seq = seq, .pending = true, .time = now, .bytes = bytes };
+  }
+
+  void acknowledge(const ReceiveWindow &received, Timer::time_t now) {
+    if(!received.any) {
+      return;
+    }
+    for(seq_t d = 0; d <= ReceiveWindow::WINDOW && d < HISTORY; ++d) {
+      const seq_t seq = received.latest - d;
+      Sent &s = sent_[seq % HISTORY];
+      if(!s.pending || s.seq != seq) {
+        continue;
+      }
+      if(received.contains(seq)) {
+        s.pending = false;
+        ++no_acked;
+        bytes_acked += s.bytes;
+        // acknowledgements are sent right away, so only the newest one is
+        // not delayed by later messages
+        if(d == 0) {
+          sample_rtt(now - s.time);
+        }
+      } else if(d >= REORDERING) {
+        s.pending = false;
+        ++no_lost;
+      }
+    }
+    adjust(now);
+  }
+
+  // to be called before sending. a receiver which acknowledges nothing for a
+  // few round trips and messages is taken to have lost everything
+  void update(Timer::time_t now) {
+    if(started && no_acked == 0 && now - period_start >= SILENCE * (rtt() + interval())) {
+      ++no_lost;
+      adjust(now);
+    }
+  }
+
+  double rate() const {
+    return rate_;
+  }
+
+  Timer::time_t interval() const {
+    return 1. / rate_;
+  }
+
+  Timer::time_t rtt() const {
+    return (srtt_ < .0) ? INITIAL_RTT : srtt_;
+  }
+
+  // fraction of messages lost
+  double loss() const {
+    return loss_;
+  }
+
+  // bytes per second acknowledged
+  double bandwidth() const {
+    return bandwidth_;
+  }
+
+  RateEstimate estimate() const {
+    return (RateEstimate){
+      .rate = rate_,
+      .loss = loss_,
+      .bandwidth = bandwidth_
+    };
+  }
+};
+
+}
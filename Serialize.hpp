@@ -0,0 +1,573 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <type_traits>
+
+#include "Logger.hpp"
+#include "Debug.hpp"
+
+namespace net {
+
+// maps small negative and positive numbers to small unsigned ones
+constexpr uint32_t zigzag(int32_t value) {
+  return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+constexpr int32_t unzigzag(uint32_t value) {
+  return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+template <typename T>
+struct Fields;
+
+// appends to a fixed buffer, integers in little endian and structs through
+// their NET_FIELDS. writes past its end are dropped and make ok() return false
+class ByteWriter {
+  uint8_t *data_;
+  size_t capacity_;
+  size_t size_ = 0;
+  bool ok_ = true;
+public:
+  ByteWriter(void *data, size_t capacity):
+    data_((uint8_t *)data), capacity_(capacity)
+  {}
+
+  template <typename T>
+  void put(const T &value) {
+    static_assert(std::is_integral_v<T>);
+    if(size_ + sizeof(T) > capacity_) {
+      ok_ = false;
+      return;
+    }
+    const std::make_unsigned_t<T> x = value;
+    for(size_t i = 0; i < sizeof(T); ++i) {
+      data_[size_ + i] = uint8_t(x >> (8 * i));
+    }
+    size_ += sizeof(T);
+  }
+
+  // starts at a byte boundary and pads the last byte
+  template <typename T>
+  void put_fields(const T &value);
+
+  // 7 bits per byte, the high bit tells whether more bytes follow
+  void put_varint(uint32_t value) {
+    while(value >= 0x80) {
+      put<uint8_t>(uint8_t(value) | 0x80);
+      value >>= 7;
+    }
+    put<uint8_t>(uint8_t(value));
+  }
+
+  void put_svarint(int32_t value) {
+    put_varint(zigzag(value));
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+};
+
+// reads from a buffer written by ByteWriter. reads past its end yield zeros
+// and make ok() return false
+class ByteReader {
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+public:
+  ByteReader(const void *data, size_t size):
+    data_((const uint8_t *)data), size_(size)
+  {}
+
+  template <typename T>
+  T get() {
+    static_assert(std::is_integral_v<T>);
+    if(pos_ + sizeof(T) > size_) {
+      ok_ = false;
+      return T(0);
+    }
+    std::make_unsigned_t<T> x = 0;
+    for(size_t i = 0; i < sizeof(T); ++i) {
+      x |= std::make_unsigned_t<T>(data_[pos_ + i]) << (8 * i);
+    }
+    pos_ += sizeof(T);
+    return T(x);
+  }
+
+  template <typename T>
+  T get_fields();
+
+  uint32_t get_varint() {
+    uint32_t value = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+      uint8_t byte = get<uint8_t>();
+      value |= uint32_t(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  int32_t get_svarint() {
+    return unzigzag(get_varint());
+  }
+
+  size_t remaining() const {
+    return size_ - pos_;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+};
+
+// appends values of any width to a fixed buffer, least significant bit
+// first, so that the layout does not depend on the host's byte order. writes
+// past its end are dropped and make ok() return false
+class BitWriter {
+  uint8_t *data_;
+  size_t capacity_;
+  size_t bits_ = 0;
+  bool ok_ = true;
+public:
+  BitWriter(void *data, size_t capacity):
+    data_((uint8_t *)data), capacity_(capacity)
+  {}
+
+  void put_bits(uint64_t value, int no_bits) {
+    if(bits_ + no_bits > capacity_ * 8) {
+      ok_ = false;
+      return;
+    }
+    for(int i = 0; i < no_bits;) {
+      const size_t byte = bits_ >> 3;
+      const int shift = bits_ & 7;
+      const int n = std::min(8 - shift, no_bits - i);
+      if(shift == 0) {
+        data_[byte] = 0;
+      }
+      data_[byte] |= uint8_t(((value >> i) & ((1u << n) - 1)) << shift);
+      i += n;
+      bits_ += n;
+    }
+  }
+
+  // copied as they are if the writer is at a byte boundary
+  void put_bytes(const void *bytes, size_t len) {
+    if(bits_ + len * 8 > capacity_ * 8) {
+      ok_ = false;
+      return;
+    }
+    if((bits_ & 7) == 0) {
+      memcpy(data_ + (bits_ >> 3), bytes, len);
+      bits_ += len * 8;
+      return;
+    }
+    for(size_t i = 0; i < len; ++i) {
+      put_bits(((const uint8_t *)bytes)[i], 8);
+    }
+  }
+
+  // groups of 7 bits, each followed by whether more follow
+  void put_varint(uint64_t value) {
+    while(value >= 0x80) {
+      put_bits((value & 0x7f) | 0x80, 8);
+      value >>= 7;
+    }
+    put_bits(value, 8);
+  }
+
+  // bytes written, the last one padded with zeros
+  size_t size() const {
+    return (bits_ + 7) / 8;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+};
+
+// reads from a buffer written by BitWriter. reads past its end yield zeros
+// and make ok() return false
+class BitReader {
+  const uint8_t *data_;
+  size_t size_;
+  size_t bits_ = 0;
+  bool ok_ = true;
+public:
+  BitReader(const void *data, size_t size):
+    data_((const uint8_t *)data), size_(size)
+  {}
+
+  uint64_t get_bits(int no_bits) {
+    if(bits_ + no_bits > size_ * 8) {
+      ok_ = false;
+      return 0;
+    }
+    uint64_t value = 0;
+    for(int i = 0; i < no_bits;) {
+      const int shift = bits_ & 7;
+      const int n = std::min(8 - shift, no_bits - i);
+      value |= uint64_t((data_[bits_ >> 3] >> shift) & ((1u << n) - 1)) << i;
+      i += n;
+      bits_ += n;
+    }
+    return value;
+  }
+
+  void get_bytes(void *bytes, size_t len) {
+    if(bits_ + len * 8 > size_ * 8) {
+      ok_ = false;
+      memset(bytes, 0x00, len);
+      return;
+    }
+    if((bits_ & 7) == 0) {
+      memcpy(bytes, data_ + (bits_ >> 3), len);
+      bits_ += len * 8;
+      return;
+    }
+    for(size_t i = 0; i < len; ++i) {
+      ((uint8_t *)bytes)[i] = get_bits(8);
+    }
+  }
+
+  uint64_t get_varint() {
+    uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+      uint64_t group = get_bits(8);
+      value |= (group & 0x7f) << shift;
+      if(!(group & 0x80)) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  // for values which turn out not to be valid
+  void fail() {
+    ok_ = false;
+  }
+
+  // bytes read, the last one with its padding
+  size_t position() const {
+    return (bits_ + 7) / 8;
+  }
+
+  // everything was read but the padding of the last byte
+  bool done() const {
+    return ok_ && size_ * 8 - bits_ < 8;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+};
+
+// codecs of single fields. each writes a value of type V in at most
+// max_bits<V> bits
+
+// unsigned integers, enums and bools in N bits
+template <int N>
+struct Bits {
+  template <typename V>
+  static constexpr size_t max_bits = N;
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    const uint64_t x = uint64_t(to_integer(value));
+    if constexpr(N < 64) {
+      ASSERT((x >> N) == 0);
+    }
+    writer.put_bits(x, N);
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    value = V(reader.get_bits(N));
+  }
+private:
+  template <typename V>
+  static constexpr auto to_integer(const V &value) {
+    if constexpr(std::is_enum_v<V>) {
+      return std::underlying_type_t<V>(value);
+    } else {
+      return value;
+    }
+  }
+};
+
+// signed integers in N bits, two's complement
+template <int N>
+struct SBits {
+  template <typename V>
+  static constexpr size_t max_bits = N;
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    const int64_t x = int64_t(value);
+    if constexpr(N < 64) {
+      ASSERT(x >= -(int64_t(1) << (N - 1)) && x < (int64_t(1) << (N - 1)));
+    }
+    writer.put_bits(uint64_t(x), N);
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    const int64_t x = int64_t(reader.get_bits(N) << (64 - N)) >> (64 - N);
+    value = V(x);
+  }
+};
+
+// unsigned integers, the smaller the fewer bytes
+struct Varint {
+  template <typename V>
+  static constexpr size_t max_bits = 8 * ((8 * sizeof(V) + 6) / 7);
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    static_assert(std::is_unsigned_v<V>);
+    writer.put_varint(value);
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    const uint64_t x = reader.get_varint();
+    if(x > std::numeric_limits<V>::max()) {
+      reader.fail();
+    }
+    value = V(x);
+  }
+};
+
+// signed integers, the closer to zero the fewer bytes
+struct SVarint {
+  template <typename V>
+  static constexpr size_t max_bits = 8 * ((8 * sizeof(V) + 7) / 7);
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    static_assert(std::is_signed_v<V>);
+    const int64_t x = value;
+    writer.put_varint((uint64_t(x) << 1) ^ uint64_t(x >> 63));
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    const uint64_t u = reader.get_varint();
+    const int64_t x = int64_t(u >> 1) ^ -int64_t(u & 1);
+    if(x < std::numeric_limits<V>::min() || x > std::numeric_limits<V>::max()) {
+      reader.fail();
+    }
+    value = V(x);
+  }
+};
+
+// floating point numbers bit for bit in their ieee 754 layout
+struct Float {
+  template <typename V>
+  static constexpr size_t max_bits = 8 * sizeof(V);
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    static_assert(std::numeric_limits<V>::is_iec559);
+    writer.put_bits(std::bit_cast<uint_of<V>>(value), 8 * sizeof(V));
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    value = std::bit_cast<V>(uint_of<V>(reader.get_bits(8 * sizeof(V))));
+  }
+private:
+  template <typename V>
+  using uint_of = std::conditional_t<sizeof(V) == 4, uint32_t, uint64_t>;
+};
+
+// zero terminated strings in a char array, by their length
+struct String {
+  template <typename V>
+  static constexpr size_t max_bits = std::bit_width(std::extent_v<V> - 1) + 8 * (std::extent_v<V> - 1);
+
+  template <size_t N>
+  static void put(BitWriter &writer, const char (&value)[N]) {
+    const size_t len = strnlen(value, N - 1);
+    writer.put_bits(len, std::bit_width(N - 1));
+    writer.put_bytes(value, len);
+  }
+
+  template <size_t N>
+  static void get(BitReader &reader, char (&value)[N]) {
+    const size_t len = reader.get_bits(std::bit_width(N - 1));
+    if(len > N - 1) {
+      reader.fail();
+      return;
+    }
+    reader.get_bytes(value, len);
+    memset(value + len, 0x00, N - len);
+  }
+};
+
+// describes how T is laid out on the wire, specialized through NET_FIELDS
+
+template <typename T, typename = void>
+struct has_fields : std::false_type {};
+
+template <typename T>
+struct has_fields<T, std::void_t<typename Fields<T>::type>> : std::true_type {};
+
+template <typename T>
+constexpr bool has_fields_v = has_fields<T>::value;
+
+// structs with fields of their own
+struct Nested {
+  template <typename V>
+  static constexpr size_t max_bits = Fields<V>::type::max_bits;
+
+  template <typename V>
+  static void put(BitWriter &writer, const V &value) {
+    Fields<V>::type::encode(writer, value);
+  }
+
+  template <typename V>
+  static void get(BitReader &reader, V &value) {
+    Fields<V>::type::decode(reader, value);
+  }
+};
+
+namespace detail {
+  template <typename P>
+  struct member_of;
+
+  template <typename S, typename M>
+  struct member_of<M S::*> {
+    using type = M;
+  };
+
+  template <auto Member>
+  using member_t = typename member_of<decltype(Member)>::type;
+}
+
+// a member written by a codec. members of packed structs are not bound to
+// references but go through a copy, arrays are only made of bytes
+template <auto Member, typename Codec>
+struct Field {
+  using type = detail::member_t<Member>;
+  static constexpr size_t max_bits = Codec::template max_bits<type>;
+
+  template <typename S>
+  static void encode(BitWriter &writer, const S &s) {
+    if constexpr(std::is_array_v<type>) {
+      Codec::put(writer, s.*Member);
+    } else {
+      const type value = s.*Member;
+      Codec::put(writer, value);
+    }
+  }
+
+  template <typename S>
+  static void decode(BitReader &reader, S &s) {
+    if constexpr(std::is_array_v<type>) {
+      Codec::get(reader, s.*Member);
+    } else {
+      type value;
+      Codec::get(reader, value);
+      s.*Member = value;
+    }
+  }
+};
+
+// a byte array of which only the first Length bytes are used, written as
+// the length followed by those bytes
+template <auto Length, auto Array>
+struct Bytes {
+  using length_type = detail::member_t<Length>;
+  using array_type = detail::member_t<Array>;
+  static_assert(sizeof(std::remove_extent_t<array_type>) == 1);
+  static constexpr size_t capacity = std::extent_v<array_type>;
+  static constexpr size_t max_bits = 8 * sizeof(length_type) + 8 * capacity;
+
+  template <typename S>
+  static void encode(BitWriter &writer, const S &s) {
+    const size_t len = s.*Length;
+    ASSERT(len <= capacity);
+    writer.put_bits(len, 8 * sizeof(length_type));
+    writer.put_bytes(s.*Array, len);
+  }
+
+  template <typename S>
+  static void decode(BitReader &reader, S &s) {
+    const size_t len = reader.get_bits(8 * sizeof(length_type));
+    if(len > capacity) {
+      reader.fail();
+      return;
+    }
+    s.*Length = length_type(len);
+    reader.get_bytes(s.*Array, len);
+  }
+};
+
+template <typename... Fs>
+struct FieldList {
+  static constexpr size_t max_bits = (Fs::max_bits + ... + 0);
+
+  template <typename S>
+  static void encode(BitWriter &writer, const S &s) {
+    (Fs::encode(writer, s), ...);
+  }
+
+  template <typename S>
+  static void decode(BitReader &reader, S &s) {
+    (Fs::decode(reader, s), ...);
+  }
+};
+
+// the members of TYPE in the order they go on the wire, each with a codec.
+// S names TYPE in the list:
+//   NET_FIELDS(pkg::foo_struct,
+//     net::Field<&S::id, net::Bits<4>>,
+//     net::Field<&S::pos, net::Nested>)
+#define NET_FIELDS(TYPE, ...) \
+  template <> struct net::Fields<TYPE> { \
+    using S = TYPE; \
+    using type = net::FieldList<__VA_ARGS__>; \
+  };
+
+template <typename T>
+void ByteWriter::put_fields(const T &value) {
+  BitWriter writer(data_ + size_, capacity_ - size_);
+  Fields<T>::type::encode(writer, value);
+  if(!writer.ok()) {
+    ok_ = false;
+    return;
+  }
+  size_ += writer.size();
+}
+
+template <typename T>
+T ByteReader::get_fields() {
+  T value = T();
+  BitReader reader(data_ + pos_, size_ - pos_);
+  Fields<T>::type::decode(reader, value);
+  if(!reader.ok()) {
+    ok_ = false;
+    pos_ = size_;
+    return T();
+  }
+  pos_ += reader.position();
+  return value;
+}
+
+}
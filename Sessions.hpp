@@ -0,0 +1,168 @@
+#pragma once
+
+#include "Debug.hpp"
+#include "Optimizations.hpp"
+#include "Network.hpp"
+#include "AddrMap.hpp"
+
+#include <cstdint>
+
+#include <vector>
+
+namespace net {
+
+// the session a server opened for the peer, sent in answer to whatever
+// opened it. the peer stamps it into everything it sends on the channel
+template <channel_t Channel>
+struct session_struct {
+  session_t session;
+} ATTRIB_PACKED;
+
+// asks for the session again, where the server knows its peers in advance
+template <channel_t Channel>
+struct session_request_struct {
+  uint8_t unused = 0;
+} ATTRIB_PACKED;
+
+template <channel_t Channel>
+struct Fields<session_struct<Channel>> {
+  using S = session_struct<Channel>;
+  using type = FieldList<Field<&S::session, Bits<16>>>;
+};
+
+template <channel_t Channel>
+struct Fields<session_request_struct<Channel>> {
+  using type = FieldList<>;
+};
+
+// the last two ids of the channel
+#define NET_SESSION_MESSAGES(CHANNEL) \
+  NET_MESSAGE(net::session_request_struct<CHANNEL>, ((CHANNEL) << 4) | 0x0e, 1) \
+  NET_MESSAGE(net::session_struct<CHANNEL>, ((CHANNEL) << 4) | 0x0f, 1)
+
+// per peer state of a server in a dense array indexed by session. the low
+// bits of a session are its slot, the high bits count how often the slot was
+// handed out, so that a stale session does not reach the slot's next owner.
+// a datagram is only taken to be of a session if it also comes from the
+// session's address
+template <typename T>
+class Sessions {
+public:
+  static constexpr int SLOT_BITS = 11;
+  static constexpr size_t CAPACITY = size_t(1) << SLOT_BITS;
+private:
+  static constexpr session_t SLOT_MASK = CAPACITY - 1;
+  static constexpr int NO_GENERATIONS = 1 << (8 * sizeof(session_t) - SLOT_BITS);
+
+  struct Slot {
+    Addr addr;
+    session_t session = NO_SESSION;
+    uint8_t generation = 0;
+    T state;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<session_t> free_slots;
+  // only for handshakes and peers which do not send their session yet
+  AddrMap<session_t> index;
+public:
+  Sessions()
+  {}
+
+  // the session of addr, opened if there is none. NO_SESSION if every slot is
+  // taken
+  session_t open(const Addr &addr) {
+    if(const session_t *session = index.find(addr)) {
+      return *session;
+    }
+    size_t i;
+    if(!free_slots.empty()) {
+      i = free_slots.back();
+      free_slots.pop_back();
+    } else if(slots.size() < CAPACITY) {
+      i = slots.size();
+      slots.emplace_back();
+    } else {
+      return NO_SESSION;
+    }
+    Slot &slot = slots[i];
+    // generation 0 is skipped, so that no session is NO_SESSION
+    slot.generation = slot.generation % (NO_GENERATIONS - 1) + 1;
+    slot.session = session_t((slot.generation << SLOT_BITS) | i);
+    slot.addr = addr;
+    slot.state = T();
+    *index.insert(addr).first = slot.session;
+    return slot.session;
+  }
+
+  void close(session_t session) {
+    Slot *slot = slot_of(session);
+    if(slot == nullptr) {
+      return;
+    }
+    index.erase(slot->addr);
+    slot->session = NO_SESSION;
+    slot->state = T();
+    free_slots.push_back(session & SLOT_MASK);
+  }
+
+  // the sender's session, from the header if it sent one and by address
+  // otherwise. NO_SESSION for strangers
+  template <typename B>
+  session_t identify(const B &blob) const {
+    const session_t session = blob.session();
+    if(session != NO_SESSION) {
+      const Slot *slot = slot_of(session);
+      return (slot != nullptr && slot->addr == blob.addr) ? session : NO_SESSION;
+    }
+    return find(blob.addr);
+  }
+
+  session_t find(const Addr &addr) const {
+    const session_t *session = index.find(addr);
+    return (session != nullptr) ? *session : NO_SESSION;
+  }
+
+  T *get(session_t session) {
+    Slot *slot = slot_of(session);
+    return (slot != nullptr) ? &slot->state : nullptr;
+  }
+
+  const Addr &addr(session_t session) const {
+    const Slot *slot = slot_of(session);
+    ASSERT(slot != nullptr);
+    return slot->addr;
+  }
+
+  // func(session, addr, state) for every open session in slot order
+  template <typename F>
+  void each(F &&func) {
+    for(Slot &slot : slots) {
+      if(slot.session != NO_SESSION) {
+        func(slot.session, std::as_const(slot.addr), slot.state);
+      }
+    }
+  }
+
+  size_t size() const {
+    return index.size();
+  }
+
+  bool empty() const {
+    return index.empty();
+  }
+private:
+  const Slot *slot_of(session_t session) const {
+    const size_t i = session & SLOT_MASK;
+    if(session == NO_SESSION || i >= slots.size() || slots[i].session != session) {
+      return nullptr;
+    }
+    return &slots[i];
+  }
+
+  Slot *slot_of(session_t session) {
+    return const_cast<Slot *>(std::as_const(*this).slot_of(session));
+  }
+};
+
+}
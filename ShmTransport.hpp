@@ -0,0 +1,438 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <ifaddrs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include "Network.hpp"
+#include "Queue.hpp"
+
+namespace net {
+
+// udp with a shortcut for peers on the same host. every socket owns an inbox,
+// a queue in a shared memory segment named after its port, which any process
+// of the host pushes datagrams into without a syscall. datagrams to peers
+// without an inbox, to other hosts, or to a full inbox go through the kernel.
+// handles are the udp sockets, and the owner's socket is woken by an empty
+// datagram only when its inbox goes from drained to not drained
+class ShmTransport : public Transport {
+  static constexpr uint32_t MAGIC = 0x6d666669;
+  static constexpr size_t INBOX_SIZE = 512;
+  // receives served from the inbox alone before the kernel is read
+  static constexpr unsigned KERNEL_PERIOD = 8;
+  // a peer without an inbox is looked up again after, the owner of an inbox
+  // checked for having died without closing it
+  static constexpr std::chrono::seconds RETRY_PERIOD{1};
+  // a sender takes microseconds to fill the cell it claimed. one which is
+  // unpublished for this long is taken to have died and is skipped
+  static constexpr std::chrono::seconds STALL_TIMEOUT{1};
+
+  struct Packet {
+    // the address it was sent to with the sender's port
+    sockaddr_in from;
+    timespec sent;
+    uint16_t size;
+    uint8_t data[MAX_DATAGRAM_SIZE];
+  };
+
+  // placed in the segment, so plain data and lock-free atomics only
+  struct Inbox {
+    // set last by the owner, with the size of its layout
+    std::atomic<uint32_t> magic;
+    uint32_t size;
+    pid_t owner;
+    std::atomic<bool> closed;
+    // a wakeup is on its way, or the owner is about to drain
+    std::atomic<bool> signaled;
+    MPSCQueue<Packet, INBOX_SIZE> queue;
+  };
+  static_assert(std::atomic<size_t>::is_always_lock_free && std::atomic<bool>::is_always_lock_free);
+
+  struct Peer {
+    Inbox *inbox = nullptr;
+    // when to look for the inbox again, or to check its owner is alive
+    std::chrono::steady_clock::time_point retry;
+  };
+
+  struct Endpoint {
+    int fd;
+    port_t port;
+    std::string name;
+    Inbox *inbox = nullptr;
+    // receives are not concurrent
+    unsigned no_kernel_skips = 0;
+    // since when the head of the inbox is claimed and unpublished, if it is
+    std::optional<std::chrono::steady_clock::time_point> stalled;
+    // guards the peers, sends and receives may come from different threads
+    std::mutex mtx;
+    std::map<port_t, Peer> peers;
+  };
+
+  KernelTransport kernel;
+  std::mutex mtx;
+  std::map<int, std::unique_ptr<Endpoint>> endpoints;
+  std::set<ip_t> local_ips;
+
+  Endpoint &endpoint(int handle) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = endpoints.find(handle);
+    ASSERT(it != std::end(endpoints));
+    return *it->second;
+  }
+
+  static std::string segment_name(port_t port) {
+    return "/minififa-" + std::to_string(port);
+  }
+
+  static Inbox *map_inbox(int fd) {
+    void *ptr = mmap(nullptr, sizeof(Inbox), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return (ptr != MAP_FAILED) ? (Inbox *)ptr : nullptr;
+  }
+
+  static void unmap_inbox(Inbox *inbox) {
+    if(inbox != nullptr) {
+      munmap(inbox, sizeof(Inbox));
+    }
+  }
+
+  bool is_local(ip_t ip) const {
+    return (ip >> 24) == 127 || local_ips.find(ip) != std::end(local_ips);
+  }
+
+  static Inbox *attach(port_t port) {
+    const int fd = shm_open(segment_name(port).c_str(), O_RDWR, 0);
+    if(fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    Inbox *inbox = nullptr;
+    if(fstat(fd, &st) == 0 && size_t(st.st_size) == sizeof(Inbox)) {
+      inbox = map_inbox(fd);
+    }
+    ::close(fd);
+    if(inbox != nullptr && (inbox->magic.load(std::memory_order_acquire) != MAGIC
+        || inbox->size != sizeof(Inbox) || inbox->closed.load()))
+    {
+      unmap_inbox(inbox);
+      inbox = nullptr;
+    }
+    return inbox;
+  }
+
+  // guarded by e.mtx. the inbox of the local peer at port, null if datagrams
+  // to it go through the kernel
+  Inbox *peer_inbox(Endpoint &e, port_t port) {
+    Peer &peer = e.peers[port];
+    if(peer.inbox != nullptr && peer.inbox->closed.load(std::memory_order_relaxed)) {
+      unmap_inbox(peer.inbox);
+      peer = Peer();
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if(now < peer.retry) {
+      return peer.inbox;
+    }
+    peer.retry = now + RETRY_PERIOD;
+    if(peer.inbox != nullptr && kill(peer.inbox->owner, 0) < 0 && errno == ESRCH) {
+      unmap_inbox(peer.inbox);
+      peer.inbox = nullptr;
+      errno = 0;
+    }
+    if(peer.inbox == nullptr) {
+      peer.inbox = attach(port);
+    }
+    return peer.inbox;
+  }
+
+  void ring(Endpoint &e, const sockaddr_in &addr) {
+    sendto(e.fd, nullptr, 0, 0, (const sockaddr *)&addr, sizeof(sockaddr_in));
+  }
+
+  // guarded by e.mtx
+  bool push(Endpoint &e, Inbox &inbox, const msghdr &hdr) {
+    const sockaddr_in &to = *(const sockaddr_in *)hdr.msg_name;
+    return inbox.queue.push_with([&](Packet &packet) mutable {
+      packet.from = to;
+      packet.from.sin_port = htons(e.port);
+      clock_gettime(CLOCK_REALTIME, &packet.sent);
+      size_t len = 0;
+      for(size_t j = 0; j < hdr.msg_iovlen; ++j) {
+        const size_t n = std::min(hdr.msg_iov[j].iov_len, sizeof(packet.data) - len);
+        memcpy(packet.data + len, hdr.msg_iov[j].iov_base, n);
+        len += n;
+      }
+      packet.size = len;
+    });
+  }
+
+  // the inbox's owner only
+  static void deliver(const Packet &packet, mmsghdr &msg) {
+    msghdr &hdr = msg.msg_hdr;
+    const size_t len = std::min<size_t>(packet.size, hdr.msg_iov[0].iov_len);
+    memcpy(hdr.msg_iov[0].iov_base, packet.data, len);
+    hdr.msg_flags = (len < packet.size) ? MSG_TRUNC : 0;
+    if(hdr.msg_name != nullptr) {
+      memcpy(hdr.msg_name, &packet.from, sizeof(sockaddr_in));
+      hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+    size_t controllen = 0;
+    if(hdr.msg_control != nullptr && hdr.msg_controllen >= CMSG_SPACE(sizeof(timespec))) {
+      cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type = SCM_TIMESTAMPNS;
+      c->cmsg_len = CMSG_LEN(sizeof(timespec));
+      memcpy(CMSG_DATA(c), &packet.sent, sizeof(timespec));
+      controllen = CMSG_SPACE(sizeof(timespec));
+    }
+    hdr.msg_controllen = controllen;
+    msg.msg_len = len;
+  }
+
+  static unsigned drain(Inbox &inbox, mmsghdr *msgs, unsigned no_msgs) {
+    unsigned received = 0;
+    for(Packet *packet; received < no_msgs && (packet = inbox.queue.front()) != nullptr; ++received) {
+      deliver(*packet, msgs[received]);
+      inbox.queue.pop();
+    }
+    return received;
+  }
+
+  // the datagrams behind a cell whose sender died are not held up for more
+  // than STALL_TIMEOUT. false unless the cell was skipped
+  static bool unstall(Endpoint &e) {
+    Inbox &inbox = *e.inbox;
+    if(!inbox.queue.claimed()) {
+      e.stalled.reset();
+      return false;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if(!e.stalled.has_value()) {
+      e.stalled = now;
+      return false;
+    }
+    if(now - e.stalled.value() < STALL_TIMEOUT || !inbox.queue.skip()) {
+      return false;
+    }
+    Logger::Warning("shm: skipped a datagram left unfinished in the inbox of port %hu\n", e.port);
+    e.stalled.reset();
+    return true;
+  }
+
+  // moves a datagram read by the kernel to an earlier slot, over a wakeup
+  static void move(mmsghdr &to, const mmsghdr &from) {
+    msghdr &hdr = to.msg_hdr;
+    memcpy(hdr.msg_iov[0].iov_base, from.msg_hdr.msg_iov[0].iov_base, from.msg_len);
+    hdr.msg_flags = from.msg_hdr.msg_flags;
+    if(hdr.msg_name != nullptr) {
+      memcpy(hdr.msg_name, from.msg_hdr.msg_name, sizeof(sockaddr_in));
+      hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+    // control buffers are all of the same size, the wakeup's carries a
+    // timestamp too
+    if(hdr.msg_control != nullptr && from.msg_hdr.msg_controllen <= hdr.msg_controllen) {
+      memcpy(hdr.msg_control, from.msg_hdr.msg_control, from.msg_hdr.msg_controllen);
+      hdr.msg_controllen = from.msg_hdr.msg_controllen;
+    } else {
+      hdr.msg_controllen = 0;
+    }
+    to.msg_len = from.msg_len;
+  }
+
+  void release(Endpoint &e) {
+    for(auto &[port, peer] : e.peers) {
+      unmap_inbox(peer.inbox);
+    }
+    if(e.inbox != nullptr) {
+      e.inbox->closed.store(true);
+      unmap_inbox(e.inbox);
+      shm_unlink(e.name.c_str());
+    }
+    kernel.close(e.fd);
+  }
+public:
+  ShmTransport() {
+    ifaddrs *ifaddr;
+    if(getifaddrs(&ifaddr) == 0) {
+      for(ifaddrs *ifa = ifaddr; ifa != nullptr; ifa = ifa->ifa_next) {
+        if(ifa->ifa_addr != nullptr && ifa->ifa_addr->sa_family == AF_INET) {
+          local_ips.insert(Addr(*(const sockaddr_in *)ifa->ifa_addr).ip);
+        }
+      }
+      freeifaddrs(ifaddr);
+    }
+  }
+
+  ~ShmTransport() {
+    for(auto &[handle, e] : endpoints) {
+      release(*e);
+    }
+  }
+
+  int open(port_t port) {
+    auto e = std::make_unique<Endpoint>();
+    e->fd = kernel.open(port);
+    sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(e->fd, (sockaddr *)&addr, &addrlen);
+    e->port = Addr(addr).port;
+    e->name = segment_name(e->port);
+
+    // the port is bound, so a segment left under its name is from a process
+    // which did not close it
+    shm_unlink(e->name.c_str());
+    const int fd = shm_open(e->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0 && ftruncate(fd, sizeof(Inbox)) == 0) {
+      e->inbox = map_inbox(fd);
+    }
+    if(fd >= 0) {
+      ::close(fd);
+    }
+    if(e->inbox != nullptr) {
+      Inbox &inbox = *e->inbox;
+      new (&inbox.queue) MPSCQueue<Packet, INBOX_SIZE>();
+      inbox.size = sizeof(Inbox);
+      inbox.owner = getpid();
+      inbox.closed.store(false);
+      inbox.signaled.store(false);
+      inbox.magic.store(MAGIC, std::memory_order_release);
+    } else {
+      Logger::Warning("shm: no inbox for port %hu: %s\n", e->port, strerror(errno));
+      shm_unlink(e->name.c_str());
+      errno = 0;
+    }
+
+    const int handle = e->fd;
+    std::lock_guard<std::mutex> guard(mtx);
+    endpoints[handle] = std::move(e);
+    return handle;
+  }
+
+  void close(int handle) {
+    std::unique_ptr<Endpoint> e;
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      auto it = endpoints.find(handle);
+      ASSERT(it != std::end(endpoints));
+      e = std::move(it->second);
+      endpoints.erase(it);
+    }
+    release(*e);
+  }
+
+  // datagrams to remote peers go out in runs with one sendmmsg each. a local
+  // peer gets one wakeup per drain at most
+  int send(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    Endpoint &e = endpoint(handle);
+    std::lock_guard<std::mutex> guard(e.mtx);
+    unsigned sent = 0;
+    // everything before i goes through the kernel first
+    auto flush = [&](unsigned i) mutable -> bool {
+      if(i == sent) {
+        return true;
+      }
+      const int ret = kernel.send(handle, msgs + sent, i - sent);
+      if(ret > 0) {
+        sent += ret;
+      }
+      return sent == i;
+    };
+    for(unsigned i = 0; i < no_msgs; ++i) {
+      const sockaddr_in &to = *(const sockaddr_in *)msgs[i].msg_hdr.msg_name;
+      const Addr addr(to);
+      Inbox *inbox = is_local(addr.ip) ? peer_inbox(e, addr.port) : nullptr;
+      if(inbox == nullptr) {
+        continue;
+      }
+      if(!flush(i)) {
+        return (sent > 0) ? int(sent) : -1;
+      }
+      // a full inbox is left to the kernel
+      if(!push(e, *inbox, msgs[i].msg_hdr)) {
+        continue;
+      }
+      msgs[i].msg_len = 0;
+      for(size_t j = 0; j < msgs[i].msg_hdr.msg_iovlen; ++j) {
+        msgs[i].msg_len += msgs[i].msg_hdr.msg_iov[j].iov_len;
+      }
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(!inbox->signaled.exchange(true)) {
+        ring(e, to);
+      }
+      sent = i + 1;
+    }
+    if(!flush(no_msgs) && sent == 0) {
+      return -1;
+    }
+    return sent;
+  }
+
+  // the inbox is read first, and the kernel only once it is drained or every
+  // few calls, so that a busy inbox costs no syscalls. the kernel is read
+  // before the inbox is taken to be drained, so that a wakeup read here is
+  // never one for a datagram pushed after that
+  int receive(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    Endpoint &e = endpoint(handle);
+    unsigned received = 0;
+    if(e.inbox != nullptr) {
+      received = drain(*e.inbox, msgs, no_msgs);
+      if(received > 0 && ++e.no_kernel_skips < KERNEL_PERIOD) {
+        return received;
+      }
+      e.no_kernel_skips = 0;
+    }
+    const int ret = (received < no_msgs) ? kernel.receive(handle, msgs + received, no_msgs - received) : 0;
+    for(int i = 0, start = received; i < ret; ++i) {
+      // wakeups are empty
+      if(msgs[start + i].msg_len == 0) {
+        continue;
+      }
+      if(unsigned(start + i) != received) {
+        move(msgs[received], msgs[start + i]);
+      }
+      ++received;
+    }
+    if(e.inbox != nullptr) {
+      Inbox &inbox = *e.inbox;
+      if(received < no_msgs) {
+        inbox.signaled.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        received += drain(inbox, msgs + received, no_msgs - received);
+        while(received < no_msgs && unstall(e)) {
+          received += drain(inbox, msgs + received, no_msgs - received);
+        }
+      }
+      // what is left needs a wakeup, unless a sender rings already
+      if(inbox.queue.front() != nullptr && !inbox.signaled.exchange(true)) {
+        ring(e, Addr(INADDR_LOOPBACK, e.port));
+      }
+    }
+    if(received == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return received;
+  }
+};
+
+inline Transport &shm_transport() {
+  static ShmTransport shm;
+  return shm;
+}
+
+}
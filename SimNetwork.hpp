@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <map>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+
+#include "Network.hpp"
+#include "Timer.hpp"
+
+namespace net {
+
+// in-process network for sockets on one machine. datagrams are addressed by
+// port only and arrive from 127.0.0.1. every direction between two ports has
+// its own random generator seeded from the network's seed, so the fate of a
+// datagram only depends on the order of datagrams on its link
+class SimNetwork : public Transport {
+public:
+  struct Conditions {
+    Timer::time_t latency = .0;
+    // uniform in [-jitter, jitter], never below zero delay
+    Timer::time_t jitter = .0;
+    double loss = .0;
+    double duplicate = .0;
+    // held back by reorder_delay on top of the latency
+    double reorder = .0;
+    Timer::time_t reorder_delay = .0;
+  };
+
+  struct Stats {
+    size_t sent = 0;
+    size_t sent_bytes = 0;
+    size_t delivered = 0;
+    size_t delivered_bytes = 0;
+    size_t lost = 0;
+    size_t duplicated = 0;
+    size_t reordered = 0;
+    // no endpoint on the port or its queue was full
+    size_t dropped = 0;
+  };
+
+  static constexpr ip_t LOOPBACK = 0x7f000001;
+  // datagrams waiting per endpoint, like a socket's receive buffer
+  static constexpr size_t QUEUE_SIZE = 1024;
+private:
+  struct Packet {
+    Addr from;
+    std::vector<uint8_t> data;
+    // realtime clock, as SO_TIMESTAMPNS reports it
+    timespec arrival;
+  };
+
+  struct Endpoint {
+    port_t port;
+    int event;
+    std::mutex mtx;
+    std::deque<Packet> queue;
+  };
+
+  struct Scheduled {
+    Timer::time_t due;
+    // keeps datagrams with the same due time in send order
+    uint64_t order;
+    port_t to;
+    mutable Packet packet;
+
+    bool operator>(const Scheduled &other) const {
+      return due > other.due || (due == other.due && order > other.order);
+    }
+  };
+
+  struct Link {
+    Conditions conditions;
+    std::mt19937_64 rng;
+  };
+
+  uint64_t seed_;
+  Conditions conditions_;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::map<int, std::unique_ptr<Endpoint>> endpoints;
+  std::map<port_t, Endpoint *> ports;
+  std::map<std::pair<port_t, port_t>, Link> links;
+  std::map<std::pair<port_t, port_t>, Conditions> link_conditions;
+  std::priority_queue<Scheduled, std::vector<Scheduled>, std::greater<Scheduled>> scheduled;
+  uint64_t no_scheduled = 0;
+  // datagrams scheduled per destination port
+  std::map<port_t, size_t> in_flight;
+  Stats stats_;
+  bool stop = false;
+  std::thread delivery_thread;
+
+  Link &link(port_t from, port_t to) {
+    auto key = std::make_pair(from, to);
+    auto it = links.find(key);
+    if(it == std::end(links)) {
+      auto cond = link_conditions.find(key);
+      Link l = {
+        .conditions = (cond != std::end(link_conditions)) ? cond->second : conditions_,
+        .rng = std::mt19937_64(seed_ ^ (uint64_t(from) << 32) ^ (uint64_t(to) << 16) ^ 0x9e3779b97f4a7c15ULL)
+      };
+      it = links.insert({key, l}).first;
+    }
+    return it->second;
+  }
+
+  void schedule(Timer::time_t due, port_t to, const Packet &packet) {
+    scheduled.push((Scheduled){ .due = due, .order = no_scheduled++, .to = to, .packet = packet });
+    ++in_flight[to];
+  }
+
+  // guarded by mtx
+  void deliver(const Scheduled &s) {
+    if(--in_flight[s.to] == 0) {
+      in_flight.erase(s.to);
+    }
+    auto it = ports.find(s.to);
+    if(it == std::end(ports)) {
+      ++stats_.dropped;
+      return;
+    }
+    Endpoint &e = *it->second;
+    std::lock_guard<std::mutex> guard(e.mtx);
+    if(e.queue.size() >= QUEUE_SIZE) {
+      ++stats_.dropped;
+      return;
+    }
+    ++stats_.delivered;
+    stats_.delivered_bytes += s.packet.data.size();
+    clock_gettime(CLOCK_REALTIME, &s.packet.arrival);
+    e.queue.push_back(std::move(s.packet));
+    uint64_t one = 1;
+    if(write(e.event, &one, sizeof(one)) != sizeof(one)) {
+      perror("error");
+    }
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while(!stop) {
+      if(scheduled.empty()) {
+        cv.wait(lock);
+        continue;
+      }
+      Timer::time_t left = scheduled.top().due - Timer::system_time();
+      if(left > .0) {
+        cv.wait_for(lock, std::chrono::duration<double>(left));
+        continue;
+      }
+      deliver(scheduled.top());
+      scheduled.pop();
+    }
+  }
+public:
+  SimNetwork(uint64_t seed):
+    SimNetwork(seed, Conditions())
+  {}
+
+  SimNetwork(uint64_t seed, Conditions conditions):
+    seed_(seed), conditions_(conditions)
+  {
+    delivery_thread = std::thread([this]() mutable {
+      run();
+    });
+  }
+
+  ~SimNetwork() {
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      stop = true;
+    }
+    cv.notify_all();
+    delivery_thread.join();
+    for(auto &[handle, e] : endpoints) {
+      ::close(e->event);
+    }
+  }
+
+  // conditions for datagrams from one port to another, the network's
+  // conditions apply to all other links
+  void set_conditions(port_t from, port_t to, Conditions conditions) {
+    std::lock_guard<std::mutex> guard(mtx);
+    link_conditions[{from, to}] = conditions;
+    auto it = links.find({from, to});
+    if(it != std::end(links)) {
+      it->second.conditions = conditions;
+    }
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> guard(mtx);
+    return stats_;
+  }
+
+  // datagrams on the way to the port or waiting to be received there
+  size_t backlog(port_t port) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto f = in_flight.find(port);
+    size_t n = (f != std::end(in_flight)) ? f->second : 0;
+    auto it = ports.find(port);
+    if(it != std::end(ports)) {
+      std::lock_guard<std::mutex> eguard(it->second->mtx);
+      n += it->second->queue.size();
+    }
+    return n;
+  }
+
+  int open(port_t port) {
+    std::lock_guard<std::mutex> guard(mtx);
+    if(ports.find(port) != std::end(ports)) {
+      TERMINATE("Can't bind socket\n");
+    }
+    auto e = std::make_unique<Endpoint>();
+    e->port = port;
+    e->event = eventfd(0, EFD_NONBLOCK);
+    if(e->event == -1) {
+      perror("error");
+      TERMINATE("Can't create simulated socket\n");
+    }
+    int handle = e->event;
+    ports[port] = e.get();
+    endpoints[handle] = std::move(e);
+    return handle;
+  }
+
+  void close(int handle) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = endpoints.find(handle);
+    ASSERT(it != std::end(endpoints));
+    ports.erase(it->second->port);
+    ::close(handle);
+    endpoints.erase(it);
+  }
+
+  int send(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = endpoints.find(handle);
+    ASSERT(it != std::end(endpoints));
+    const port_t from = it->second->port;
+    const Timer::time_t now = Timer::system_time();
+    for(unsigned i = 0; i < no_msgs; ++i) {
+      const msghdr &hdr = msgs[i].msg_hdr;
+      const Addr to(*(const sockaddr_in *)hdr.msg_name);
+      Packet packet = { .from = Addr(LOOPBACK, from), .data = {}, .arrival = {} };
+      for(size_t j = 0; j < hdr.msg_iovlen; ++j) {
+        const uint8_t *base = (const uint8_t *)hdr.msg_iov[j].iov_base;
+        packet.data.insert(std::end(packet.data), base, base + hdr.msg_iov[j].iov_len);
+      }
+      msgs[i].msg_len = packet.data.size();
+      ++stats_.sent;
+      stats_.sent_bytes += packet.data.size();
+
+      Link &l = link(from, to.port);
+      const Conditions &c = l.conditions;
+      std::uniform_real_distribution<double> uniform(.0, 1.);
+      if(uniform(l.rng) < c.loss) {
+        ++stats_.lost;
+        continue;
+      }
+      int copies = 1;
+      if(uniform(l.rng) < c.duplicate) {
+        ++stats_.duplicated;
+        copies = 2;
+      }
+      for(int k = 0; k < copies; ++k) {
+        Timer::time_t delay = c.latency + c.jitter * (2 * uniform(l.rng) - 1);
+        if(uniform(l.rng) < c.reorder) {
+          ++stats_.reordered;
+          delay += c.reorder_delay;
+        }
+        schedule(now + std::fmax(delay, .0), to.port, packet);
+      }
+    }
+    cv.notify_all();
+    return no_msgs;
+  }
+
+  int receive(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    Endpoint *e;
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      auto it = endpoints.find(handle);
+      ASSERT(it != std::end(endpoints));
+      e = it->second.get();
+    }
+    std::lock_guard<std::mutex> guard(e->mtx);
+    unsigned received = 0;
+    for(; received < no_msgs && !e->queue.empty(); ++received) {
+      const Packet &packet = e->queue.front();
+      msghdr &hdr = msgs[received].msg_hdr;
+      size_t len = std::min(packet.data.size(), hdr.msg_iov[0].iov_len);
+      memcpy(hdr.msg_iov[0].iov_base, packet.data.data(), len);
+      hdr.msg_flags = (len < packet.data.size()) ? MSG_TRUNC : 0;
+      if(hdr.msg_name != nullptr) {
+        *(sockaddr_in *)hdr.msg_name = packet.from;
+        hdr.msg_namelen = sizeof(sockaddr_in);
+      }
+      // every endpoint behaves like a socket with receive timestamps
+      if(hdr.msg_control != nullptr && hdr.msg_controllen >= CMSG_SPACE(sizeof(timespec))) {
+        hdr.msg_controllen = CMSG_SPACE(sizeof(timespec));
+        cmsghdr *c = CMSG_FIRSTHDR(&hdr);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_TIMESTAMPNS;
+        c->cmsg_len = CMSG_LEN(sizeof(timespec));
+        memcpy(CMSG_DATA(c), &packet.arrival, sizeof(timespec));
+      } else {
+        hdr.msg_controllen = 0;
+      }
+      msgs[received].msg_len = len;
+      e->queue.pop_front();
+    }
+    // stays readable as long as something is queued
+    if(e->queue.empty()) {
+      uint64_t count;
+      if(read(e->event, &count, sizeof(count)) != sizeof(count)) {
+        errno = 0;
+      }
+    }
+    if(received == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return received;
+  }
+};
+
+}
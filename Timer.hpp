@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cmath>
 #include <cstdio>
 #include <climits>
 #include <map>
@@ -22,11 +23,16 @@ struct Timer {
   }
 
   static time_t system_time() {
+    return system_time(std::chrono::system_clock::now());
+  }
+
+  // the same clock at a point in time reported by the system, e.g. by the
+  // kernel
+  static time_t system_time(std::chrono::system_clock::time_point systime) {
     static std::mutex mtx;
     static auto systime_start = std::chrono::system_clock::now();
     std::lock_guard<std::mutex> guard(mtx);
-    auto systime_now = std::chrono::system_clock::now();
-    return 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(systime_now - systime_start).count();
+    return 1e-9 * std::chrono::duration_cast<std::chrono::nanoseconds>(systime - systime_start).count();
   }
 
   time_t prev_time = time_start();
@@ -92,6 +98,18 @@ struct Timer {
     return elapsed(key) > timeout;
   }
 
+  // time until the earliest timeout is due, infinity if there are none
+  time_t time_left() const {
+    time_t left = std::numeric_limits<time_t>::infinity();
+    for(const auto &[key, timeout] : timeouts) {
+      if(events.find(key) == events.end()) {
+        return .0;
+      }
+      left = std::fmin(left, events.at(key) + timeout - current_time);
+    }
+    return std::fmax(left, .0);
+  }
+
   template <typename F>
   void periodic(key_t key, F &&func) {
     if(timed_out(key)) {
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <vector>
+#include <utility>
+
+#include "Timer.hpp"
+
+// deadlines rounded up to ticks in wheels of slots, where every wheel's slot
+// spans a whole turn of the wheel below. an item goes into the lowest wheel
+// which reaches its deadline and moves down a wheel whenever the one below
+// completes a turn, so scheduling is constant time and every item is moved
+// at most once per wheel until it is due. items are never cancelled: whoever
+// gets one which is due decides whether it still is, and schedules it again
+// otherwise
+template <typename T>
+class TimingWheel {
+  static constexpr int SLOT_BITS = 6;
+  static constexpr uint64_t NO_SLOTS = uint64_t(1) << SLOT_BITS;
+  static constexpr int NO_WHEELS = 4;
+
+  struct Item {
+    uint64_t deadline;
+    T value;
+  };
+
+  Timer::time_t tick_;
+  Timer::time_t start;
+  // every tick up to and including it has been advanced over
+  uint64_t current = 0;
+  std::vector<Item> slots[NO_WHEELS][NO_SLOTS];
+  size_t size_ = 0;
+
+  void place(Item &&item) {
+    const uint64_t delta = item.deadline - current;
+    int wheel = 0;
+    while(wheel < NO_WHEELS - 1 && delta >= (NO_SLOTS << (SLOT_BITS * wheel))) {
+      ++wheel;
+    }
+    const size_t slot = (item.deadline >> (SLOT_BITS * wheel)) & (NO_SLOTS - 1);
+    slots[wheel][slot].push_back(std::move(item));
+  }
+
+  // the turn of every wheel below which completes at the current tick
+  void cascade() {
+    for(int wheel = 1; wheel < NO_WHEELS; ++wheel) {
+      if(current & ((uint64_t(1) << (SLOT_BITS * wheel)) - 1)) {
+        break;
+      }
+      std::vector<Item> items;
+      items.swap(slots[wheel][(current >> (SLOT_BITS * wheel)) & (NO_SLOTS - 1)]);
+      for(Item &item : items) {
+        place(std::move(item));
+      }
+    }
+  }
+public:
+  TimingWheel(Timer::time_t tick, Timer::time_t start=Timer::time_start()):
+    tick_(tick), start(start)
+  {}
+
+  // value is handed out at the first tick at or after when
+  void schedule(Timer::time_t when, T value) {
+    const Timer::time_t ticks = std::ceil((when - start) / tick_);
+    const uint64_t deadline = (ticks > Timer::time_t(current + 1)) ? uint64_t(ticks) : current + 1;
+    place((Item){ .deadline = deadline, .value = std::move(value) });
+    ++size_;
+  }
+
+  // func(value) for everything due until now, in the order of the deadlines
+  template <typename F>
+  void advance(Timer::time_t now, F &&func) {
+    const Timer::time_t ticks = std::floor((now - start) / tick_);
+    if(ticks <= Timer::time_t(current)) {
+      return;
+    }
+    const uint64_t until = uint64_t(ticks);
+    std::vector<Item> due;
+    while(current < until) {
+      ++current;
+      cascade();
+      due.clear();
+      due.swap(slots[0][current & (NO_SLOTS - 1)]);
+      size_ -= due.size();
+      // func may schedule again, into a later slot
+      for(Item &item : due) {
+        func(std::move(item.value));
+      }
+    }
+  }
+
+  Timer::time_t tick() const {
+    return tick_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Optimizations.hpp"
+
+namespace net {
+
+// binary packet trace: a header followed by one record per datagram, each
+// record followed by the datagram's bytes. integers are in host byte order
+enum class TraceDirection : uint8_t {
+  RECEIVED, SENT
+};
+
+struct TraceHeader {
+  char magic[4];
+  uint8_t version;
+} ATTRIB_PACKED;
+
+struct TraceRecord {
+  // CLOCK_MONOTONIC in nanoseconds
+  uint64_t time;
+  // sender of received datagrams, destination of sent ones
+  uint32_t ip;
+  uint16_t port;
+  uint16_t size;
+  TraceDirection direction;
+} ATTRIB_PACKED;
+
+// version 2: datagram headers carry a session
+// version 3: messages are bit-packed through NET_FIELDS
+constexpr TraceHeader TRACE_HEADER = { .magic = {'M', 'F', 'T', 'R'}, .version = 3 };
+
+inline uint64_t monotonic_time() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// records can be written from any thread
+class TraceWriter {
+  FILE *file = nullptr;
+  std::mutex mtx;
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+  std::vector<char> buffer;
+public:
+  TraceWriter()
+  {}
+
+  bool open(const std::string &filename) {
+    std::lock_guard<std::mutex> guard(mtx);
+    ASSERT(file == nullptr);
+    file = fopen(filename.c_str(), "wb");
+    if(file == nullptr) {
+      return false;
+    }
+    buffer.resize(BUFFER_SIZE);
+    setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+    fwrite(&TRACE_HEADER, sizeof(TraceHeader), 1, file);
+    return true;
+  }
+
+  void write(TraceDirection direction, uint32_t ip, uint16_t port, const void *data, size_t size) {
+    TraceRecord record = {
+      .time = monotonic_time(),
+      .ip = ip,
+      .port = port,
+      .size = uint16_t(size),
+      .direction = direction
+    };
+    std::lock_guard<std::mutex> guard(mtx);
+    if(file == nullptr) {
+      return;
+    }
+    fwrite(&record, sizeof(TraceRecord), 1, file);
+    fwrite(data, record.size, 1, file);
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> guard(mtx);
+    if(file != nullptr) {
+      fclose(file);
+      file = nullptr;
+    }
+  }
+
+  ~TraceWriter() {
+    close();
+  }
+};
+
+class TraceReader {
+  FILE *file = nullptr;
+public:
+  TraceReader()
+  {}
+
+  bool open(const std::string &filename) {
+    file = fopen(filename.c_str(), "rb");
+    if(file == nullptr) {
+      return false;
+    }
+    TraceHeader header;
+    if(fread(&header, sizeof(TraceHeader), 1, file) != 1
+      || memcmp(header.magic, TRACE_HEADER.magic, sizeof(header.magic))
+      || header.version != TRACE_HEADER.version)
+    {
+      fclose(file);
+      file = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // false at the end of the trace or if it is cut off
+  bool next(TraceRecord &record, std::vector<uint8_t> &data) {
+    if(file == nullptr || fread(&record, sizeof(TraceRecord), 1, file) != 1) {
+      return false;
+    }
+    data.resize(record.size);
+    return record.size == 0 || fread(data.data(), record.size, 1, file) == 1;
+  }
+
+  ~TraceReader() {
+    if(file != nullptr) {
+      fclose(file);
+    }
+  }
+};
+
+}
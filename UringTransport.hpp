@@ -0,0 +1,334 @@
+#pragma once
+
+#ifdef COMPILE_IOURING
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <liburing.h>
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "Network.hpp"
+
+namespace net {
+
+// udp through io_uring. every socket keeps a multishot receive armed over a
+// ring of provided buffers, so that the kernel fills them without a syscall
+// per datagram. sends are only queued, and go out with a single
+// io_uring_enter on the socket's next flush or receive. handles are the
+// rings' descriptors, which are readable while completions are waiting
+class UringTransport : public Transport {
+  static constexpr unsigned NO_ENTRIES = 256;
+  static constexpr unsigned NO_COMPLETIONS = 4096;
+  // provided receive buffers per socket, a power of two
+  static constexpr unsigned NO_BUFFERS = 1024;
+  static constexpr uint16_t BUFFER_GROUP = 0;
+  static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(timespec));
+  static constexpr size_t BUFFER_SIZE = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + CONTROL_SIZE + MAX_DATAGRAM_SIZE;
+  // datagrams being sent per socket. they are copied, since the kernel may
+  // read them after send() returned
+  static constexpr unsigned NO_SEND_SLOTS = 512;
+  static constexpr uint64_t RECEIVE_TAG = ~uint64_t(0);
+
+  struct SendSlot {
+    uint8_t data[MAX_DATAGRAM_SIZE];
+    sockaddr_in addr;
+    iovec iov;
+    msghdr hdr;
+  };
+
+  struct Endpoint {
+    int fd;
+    io_uring ring;
+    io_uring_buf_ring *buffer_ring = nullptr;
+    std::unique_ptr<uint8_t[]> buffers;
+    // layout of the receive buffers, has to outlive the multishot receive
+    msghdr receive_hdr;
+    bool armed = false;
+    std::unique_ptr<SendSlot[]> send_slots;
+    std::vector<unsigned> free_slots;
+    // the ring is not safe to be used by several threads at once
+    std::mutex mtx;
+  };
+
+  KernelTransport kernel;
+  std::mutex mtx;
+  std::map<int, std::unique_ptr<Endpoint>> endpoints;
+
+  Endpoint &endpoint(int handle) {
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = endpoints.find(handle);
+    ASSERT(it != std::end(endpoints));
+    return *it->second;
+  }
+
+  uint8_t *buffer(Endpoint &e, unsigned bid) {
+    return &e.buffers[size_t(bid) * BUFFER_SIZE];
+  }
+
+  // guarded by e.mtx
+  void arm(Endpoint &e) {
+    io_uring_sqe *sqe = io_uring_get_sqe(&e.ring);
+    if(sqe == nullptr) {
+      io_uring_submit(&e.ring);
+      sqe = io_uring_get_sqe(&e.ring);
+    }
+    ASSERT(sqe != nullptr);
+    io_uring_prep_recvmsg_multishot(sqe, e.fd, &e.receive_hdr, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, RECEIVE_TAG);
+    e.armed = true;
+  }
+
+  // guarded by e.mtx. a completed send frees its slot
+  void complete_send(Endpoint &e, const io_uring_cqe *cqe) {
+    const unsigned i = unsigned(cqe->user_data);
+    if(cqe->res < 0) {
+      Logger::Warning("uring: send to %s failed: %s\n", Addr(e.send_slots[i].addr).to_str().c_str(), strerror(-cqe->res));
+    }
+    e.free_slots.push_back(i);
+  }
+
+  // guarded by e.mtx. completed sends free their slots, datagrams are left
+  // for receive()
+  void reap_sends(Endpoint &e, size_t no_slots) {
+    io_uring_cqe *cqe;
+    while(e.free_slots.size() < no_slots && io_uring_peek_cqe(&e.ring, &cqe) == 0 && cqe->user_data != RECEIVE_TAG) {
+      complete_send(e, cqe);
+      io_uring_cqe_seen(&e.ring, cqe);
+    }
+  }
+
+  // guarded by e.mtx
+  void submit(Endpoint &e) {
+    if(io_uring_sq_ready(&e.ring) > 0) {
+      io_uring_submit(&e.ring);
+    }
+  }
+
+  // guarded by e.mtx. copies a received datagram out of its provided buffer,
+  // false if it is to be skipped
+  bool complete_receive(Endpoint &e, const io_uring_cqe *cqe, mmsghdr &msg, unsigned &no_returned) {
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+      e.armed = false;
+    }
+    if(cqe->res < 0) {
+      // out of buffers, rearmed once they are returned
+      if(cqe->res == -ENOBUFS) {
+        return false;
+      }
+      if(cqe->res == -EINVAL) {
+        TERMINATE("Multishot receives are not supported by this kernel\n");
+      }
+      Logger::Warning("uring: receive failed: %s\n", strerror(-cqe->res));
+      return false;
+    }
+    if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+      return false;
+    }
+    const unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *buf = buffer(e, bid);
+    io_uring_buf_ring_add(e.buffer_ring, buf, BUFFER_SIZE, bid, io_uring_buf_ring_mask(NO_BUFFERS), no_returned++);
+    io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buf, cqe->res, &e.receive_hdr);
+    if(out == nullptr) {
+      return false;
+    }
+    msghdr &hdr = msg.msg_hdr;
+    const size_t size = io_uring_recvmsg_payload_length(out, cqe->res, &e.receive_hdr);
+    const size_t len = std::min(size, hdr.msg_iov[0].iov_len);
+    memcpy(hdr.msg_iov[0].iov_base, io_uring_recvmsg_payload(out, &e.receive_hdr), len);
+    hdr.msg_flags = out->flags | ((len < size) ? MSG_TRUNC : 0);
+    if(hdr.msg_name != nullptr) {
+      memcpy(hdr.msg_name, io_uring_recvmsg_name(out), std::min<size_t>(out->namelen, sizeof(sockaddr_in)));
+      hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+    size_t controllen = 0;
+    cmsghdr *c = io_uring_recvmsg_cmsg_firsthdr(out, &e.receive_hdr);
+    for(; c != nullptr; c = io_uring_recvmsg_cmsg_nexthdr(out, &e.receive_hdr, c)) {
+      if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS
+        && hdr.msg_control != nullptr && hdr.msg_controllen >= CMSG_SPACE(sizeof(timespec)))
+      {
+        memcpy(hdr.msg_control, c, CMSG_SPACE(sizeof(timespec)));
+        controllen = CMSG_SPACE(sizeof(timespec));
+        break;
+      }
+    }
+    hdr.msg_controllen = controllen;
+    msg.msg_len = len;
+    return true;
+  }
+
+  // guarded by e.mtx. reaps completions until no_msgs datagrams are received
+  unsigned reap(Endpoint &e, mmsghdr *msgs, unsigned no_msgs) {
+    unsigned received = 0, no_returned = 0;
+    io_uring_cqe *cqe;
+    while(received < no_msgs && io_uring_peek_cqe(&e.ring, &cqe) == 0) {
+      if(cqe->user_data == RECEIVE_TAG) {
+        if(complete_receive(e, cqe, msgs[received], no_returned)) {
+          ++received;
+        }
+      } else {
+        complete_send(e, cqe);
+      }
+      io_uring_cqe_seen(&e.ring, cqe);
+    }
+    if(no_returned > 0) {
+      io_uring_buf_ring_advance(e.buffer_ring, no_returned);
+    }
+    if(!e.armed) {
+      arm(e);
+    }
+    submit(e);
+    return received;
+  }
+public:
+  UringTransport()
+  {}
+
+  ~UringTransport() {
+    for(auto &[handle, e] : endpoints) {
+      io_uring_free_buf_ring(&e->ring, e->buffer_ring, NO_BUFFERS, BUFFER_GROUP);
+      io_uring_queue_exit(&e->ring);
+      kernel.close(e->fd);
+    }
+  }
+
+  int open(port_t port) {
+    auto e = std::make_unique<Endpoint>();
+    e->fd = kernel.open(port);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = NO_COMPLETIONS;
+    int ret = io_uring_queue_init_params(NO_ENTRIES, &e->ring, &params);
+    if(ret < 0) {
+      errno = -ret;
+      perror("error");
+      TERMINATE("Can't create io_uring\n");
+    }
+
+    e->buffer_ring = io_uring_setup_buf_ring(&e->ring, NO_BUFFERS, BUFFER_GROUP, 0, &ret);
+    if(e->buffer_ring == nullptr) {
+      errno = -ret;
+      perror("error");
+      TERMINATE("Can't register receive buffers with io_uring\n");
+    }
+    e->buffers.reset(new uint8_t[size_t(NO_BUFFERS) * BUFFER_SIZE]);
+    for(unsigned i = 0; i < NO_BUFFERS; ++i) {
+      io_uring_buf_ring_add(e->buffer_ring, buffer(*e, i), BUFFER_SIZE, i, io_uring_buf_ring_mask(NO_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(e->buffer_ring, NO_BUFFERS);
+
+    memset(&e->receive_hdr, 0, sizeof(msghdr));
+    e->receive_hdr.msg_namelen = sizeof(sockaddr_in);
+    e->receive_hdr.msg_controllen = CONTROL_SIZE;
+
+    e->send_slots.reset(new SendSlot[NO_SEND_SLOTS]);
+    for(unsigned i = 0; i < NO_SEND_SLOTS; ++i) {
+      e->free_slots.push_back(NO_SEND_SLOTS - 1 - i);
+    }
+
+    arm(*e);
+    io_uring_submit(&e->ring);
+
+    const int handle = e->ring.ring_fd;
+    std::lock_guard<std::mutex> guard(mtx);
+    endpoints[handle] = std::move(e);
+    return handle;
+  }
+
+  void close(int handle) {
+    std::unique_ptr<Endpoint> e;
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      auto it = endpoints.find(handle);
+      ASSERT(it != std::end(endpoints));
+      e = std::move(it->second);
+      endpoints.erase(it);
+    }
+    io_uring_free_buf_ring(&e->ring, e->buffer_ring, NO_BUFFERS, BUFFER_GROUP);
+    io_uring_queue_exit(&e->ring);
+    kernel.close(e->fd);
+  }
+
+  // queues as many datagrams as there are free slots. only when the slots
+  // or the submission queue run out is what was queued submitted early
+  int send(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    Endpoint &e = endpoint(handle);
+    std::lock_guard<std::mutex> guard(e.mtx);
+    reap_sends(e, no_msgs);
+    if(e.free_slots.size() < no_msgs && io_uring_sq_ready(&e.ring) > 0) {
+      submit(e);
+      reap_sends(e, no_msgs);
+    }
+    unsigned queued = 0;
+    for(; queued < no_msgs && !e.free_slots.empty(); ++queued) {
+      io_uring_sqe *sqe = io_uring_get_sqe(&e.ring);
+      if(sqe == nullptr) {
+        submit(e);
+        sqe = io_uring_get_sqe(&e.ring);
+      }
+      if(sqe == nullptr) {
+        break;
+      }
+      const msghdr &hdr = msgs[queued].msg_hdr;
+      const unsigned i = e.free_slots.back();
+      e.free_slots.pop_back();
+      SendSlot &slot = e.send_slots[i];
+      size_t len = 0;
+      for(size_t j = 0; j < hdr.msg_iovlen; ++j) {
+        const size_t n = std::min(hdr.msg_iov[j].iov_len, sizeof(slot.data) - len);
+        memcpy(slot.data + len, hdr.msg_iov[j].iov_base, n);
+        len += n;
+      }
+      memcpy(&slot.addr, hdr.msg_name, sizeof(sockaddr_in));
+      slot.iov = { .iov_base = slot.data, .iov_len = len };
+      memset(&slot.hdr, 0, sizeof(msghdr));
+      slot.hdr.msg_name = &slot.addr;
+      slot.hdr.msg_namelen = sizeof(sockaddr_in);
+      slot.hdr.msg_iov = &slot.iov;
+      slot.hdr.msg_iovlen = 1;
+      io_uring_prep_sendmsg(sqe, e.fd, &slot.hdr, 0);
+      io_uring_sqe_set_data64(sqe, i);
+      msgs[queued].msg_len = len;
+    }
+    if(queued == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return queued;
+  }
+
+  int receive(int handle, mmsghdr *msgs, unsigned no_msgs) {
+    Endpoint &e = endpoint(handle);
+    std::lock_guard<std::mutex> guard(e.mtx);
+    unsigned received = reap(e, msgs, no_msgs);
+    if(received == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    return received;
+  }
+
+  void submit(int handle) {
+    Endpoint &e = endpoint(handle);
+    std::lock_guard<std::mutex> guard(e.mtx);
+    submit(e);
+  }
+};
+
+inline Transport &uring_transport() {
+  static UringTransport uring;
+  return uring;
+}
+
+}
+
+#endif
@@ -1,11 +1,46 @@
 #define GLM_ENABLE_EXPERIMENTAL
+#include <cstring>
+
 #include "MetaServer.hpp"
+// built along so that it keeps compiling. it is not selectable until it has
+// been run against a kernel with multishot receives
+#ifdef COMPILE_IOURING
+#include "UringTransport.hpp"
+#endif
 
 int main(int argc ,char *argv[]) {
   Logger::Setup("metaserver.log");
   Logger::MirrorLog(stderr);
-  net::port_t port = (argc == 2) ? atoi(argv[1]) : 5678;
-  MetaServer metaserver(port);
+  net::port_t port = 5678;
+  const char *trace = nullptr;
+  const char *metrics = nullptr;
+  net::Transport *transport = &net::kernel_transport();
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+      trace = argv[++i];
+    } else if(!strcmp(argv[i], "-m") && i + 1 < argc) {
+      metrics = argv[++i];
+    } else if(!strcmp(argv[i], "-s")) {
+      transport = &net::shm_transport();
+    } else {
+      port = atoi(argv[i]);
+    }
+  }
+  MetaServer metaserver(port, *transport);
+  // record the traffic for replay
+  if(trace != nullptr) {
+    metaserver.socket.capture(trace);
+  }
+  // one json line of traffic counters every few seconds
+  if(metrics != nullptr) {
+    metaserver.metrics_file = fopen(metrics, "a");
+    if(metaserver.metrics_file == nullptr) {
+      TERMINATE("Can't open %s\n", metrics);
+    }
+  }
   metaserver.run();
+  if(metaserver.metrics_file != nullptr) {
+    fclose(metaserver.metrics_file);
+  }
   Logger::Close();
 }
@@ -0,0 +1,240 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+
+#include <map>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include "MetaServer.hpp"
+#include "Soccer.hpp"
+#include "Intelligence.hpp"
+#include "SimNetwork.hpp"
+#include "Trace.hpp"
+
+// feeds the datagrams a captured socket received back into a server on a
+// simulated network, every recorded sender getting a port of its own, and
+// reports how many of them the server's handlers got through per second
+
+struct Recorded {
+  uint64_t time;
+  net::Addr from;
+  std::vector<uint8_t> data;
+};
+
+constexpr net::port_t SERVER_PORT = 5678;
+constexpr net::port_t FIRST_PEER_PORT = 20000;
+constexpr size_t MAX_BACKLOG = net::SimNetwork::QUEUE_SIZE / 2;
+
+void usage(const char *prog) {
+  fprintf(stderr, "usage: %s <trace> metaserver|soccer [-r] [-t team1 team2]\n", prog);
+  fprintf(stderr, "  -r  replay at recorded speed instead of as fast as possible\n");
+  fprintf(stderr, "  -t  team sizes of the soccer server\n");
+}
+
+// the first message decides the channel, bundles go through as they are
+bool belongs_to(const std::vector<uint8_t> &data, net::channel_t channel) {
+  if(data.size() < sizeof(net::Header)) {
+    return false;
+  }
+  return data[0] == net::BUNDLE_ID || net::channel_of(data[0]) == channel;
+}
+
+// the server hands out sessions again in the order the replayed senders
+// show up, so that the recorded ones are not taken for stale ones
+void clear_session(uint8_t *message) {
+  const net::session_t session = net::NO_SESSION;
+  memcpy(message + offsetof(net::Header, session), &session, sizeof(session));
+}
+
+void clear_sessions(std::vector<uint8_t> &data) {
+  clear_session(data.data());
+  if(data[0] != net::BUNDLE_ID || !net::is_valid_bundle(data.data(), data.size())) {
+    return;
+  }
+  for(size_t offset = sizeof(net::Header); offset < data.size();) {
+    uint16_t len;
+    memcpy(&len, &data[offset], sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+    clear_session(&data[offset]);
+    offset += le16toh(len);
+  }
+}
+
+std::vector<Recorded> load(const char *filename, net::channel_t channel) {
+  net::TraceReader reader;
+  if(!reader.open(filename)) {
+    TERMINATE("Can't read trace %s\n", filename);
+  }
+  std::vector<Recorded> datagrams;
+  net::TraceRecord record;
+  std::vector<uint8_t> data;
+  while(reader.next(record, data)) {
+    if(record.direction != net::TraceDirection::RECEIVED || !belongs_to(data, channel)) {
+      continue;
+    }
+    clear_sessions(data);
+    datagrams.push_back((Recorded){
+      .time = record.time,
+      .from = net::Addr(record.ip, record.port),
+      .data = data
+    });
+  }
+  return datagrams;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 3) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *filename = argv[1];
+  const std::string target = argv[2];
+  bool realtime = false;
+  int team1 = 1, team2 = 2;
+  for(int i = 3; i < argc; ++i) {
+    if(!strcmp(argv[i], "-r")) {
+      realtime = true;
+    } else if(!strcmp(argv[i], "-t") && i + 2 < argc) {
+      team1 = atoi(argv[i + 1]), team2 = atoi(argv[i + 2]);
+      i += 2;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(target != "metaserver" && target != "soccer") {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Logger::Setup("replay.log");
+  const net::channel_t channel = (target == "metaserver") ? pkg::METASERVER_CHANNEL : pkg::MATCH_CHANNEL;
+  std::vector<Recorded> datagrams = load(filename, channel);
+  if(datagrams.empty()) {
+    fprintf(stderr, "replay: nothing to replay\n");
+    Logger::Close();
+    return EXIT_SUCCESS;
+  }
+
+  net::SimNetwork network(0);
+
+  // the simulated network tells senders apart by port only
+  std::map<net::Addr, int> peers;
+  std::set<net::Addr> clients;
+  for(const auto &d : datagrams) {
+    if(peers.find(d.from) == std::end(peers)) {
+      net::port_t port = FIRST_PEER_PORT + peers.size();
+      peers[d.from] = network.open(port);
+      clients.insert(net::Addr(net::SimNetwork::LOOPBACK, port));
+    }
+  }
+
+  std::unique_ptr<MetaServer> metaserver;
+  std::thread metaserver_thread;
+  std::unique_ptr<Soccer> soccer;
+  std::unique_ptr<net::Socket<net::SocketType::UDP>> socket;
+  std::unique_ptr<net::SchedulerThread> scheduler_thread;
+  std::unique_ptr<SoccerServer> server;
+  std::atomic<bool> stop_idle = false;
+  std::thread idle_thread;
+  if(target == "metaserver") {
+    metaserver.reset(new MetaServer(SERVER_PORT, network));
+    metaserver_thread = std::thread([&]() mutable {
+      metaserver->run();
+    });
+  } else {
+    soccer.reset(new Soccer(team1, team2));
+    socket.reset(new net::Socket<net::SocketType::UDP>(SERVER_PORT, net::Socket<net::SocketType::UDP>::Mode::DIRECT, network));
+    scheduler_thread.reset(new net::SchedulerThread());
+    server.reset(new SoccerServer(0, *soccer, *socket, scheduler_thread->scheduler(), clients));
+    server->start();
+    // the game loop advances the match next to the server thread
+    idle_thread = std::thread([&]() mutable {
+      while(!stop_idle) {
+        server->idle(Timer::system_time());
+        std::this_thread::sleep_for(std::chrono::milliseconds(16));
+      }
+    });
+  }
+
+  // whatever the server sends back is thrown away
+  auto discard_replies = [&]() mutable {
+    uint8_t buffer[net::MAX_DATAGRAM_SIZE];
+    iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+    mmsghdr msg;
+    for(auto &[addr, handle] : peers) {
+      do {
+        memset(&msg, 0, sizeof(mmsghdr));
+        msg.msg_hdr.msg_iov = &iov;
+        msg.msg_hdr.msg_iovlen = 1;
+      } while(network.receive(handle, &msg, 1) > 0);
+    }
+    errno = 0;
+  };
+
+  const net::Addr server_addr(net::SimNetwork::LOOPBACK, SERVER_PORT);
+  const Timer::time_t start = Timer::system_time();
+  const uint64_t first = datagrams.front().time;
+  size_t bytes = 0;
+  for(size_t i = 0; i < datagrams.size(); ++i) {
+    const Recorded &d = datagrams[i];
+    if(realtime) {
+      Timer::time_t due = start + (d.time - first) * 1e-9;
+      Timer::time_t left = due - Timer::system_time();
+      if(left > .0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(left));
+      }
+    } else {
+      // keep the server busy without overflowing its receive queue
+      while(network.backlog(SERVER_PORT) >= MAX_BACKLOG) {
+        discard_replies();
+        std::this_thread::yield();
+      }
+    }
+    sockaddr_in address = server_addr;
+    iovec iov = { .iov_base = (void *)d.data.data(), .iov_len = d.data.size() };
+    mmsghdr msg;
+    memset(&msg, 0, sizeof(mmsghdr));
+    msg.msg_hdr.msg_name = &address;
+    msg.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+    network.send(peers[d.from], &msg, 1);
+    bytes += d.data.size();
+    if(i % 64 == 0) {
+      discard_replies();
+    }
+  }
+
+  // done once the server's queue ran empty
+  while(network.backlog(SERVER_PORT) > 0) {
+    discard_replies();
+    std::this_thread::yield();
+  }
+  const Timer::time_t elapsed = Timer::system_time() - start;
+  const net::SimNetwork::Stats stats = network.stats();
+
+  size_t inbox_dropped;
+  if(metaserver) {
+    inbox_dropped = metaserver->socket.dropped(channel);
+    metaserver->stop();
+    metaserver_thread.join();
+  } else {
+    inbox_dropped = socket->dropped(channel);
+    server->stop();
+    stop_idle = true;
+    idle_thread.join();
+  }
+
+  const size_t recorded_span = datagrams.back().time - first;
+  printf("replayed %lu datagrams (%lu bytes) to %s in %.3fs, recorded over %.3fs\n",
+    datagrams.size(), bytes, target.c_str(), elapsed, recorded_span * 1e-9);
+  printf("%.0f datagrams/s, %lu dropped by the server's receive queue, %lu by its inbox\n",
+    datagrams.size() / elapsed, stats.dropped, inbox_dropped);
+  Logger::Close();
+}